@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_brightness.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "mgos.h"
+
+namespace clk {
+
+// Lowest level is this fraction of the full pulse length.
+static constexpr float kMinFactor = 0.01f;
+
+static uint16_t ScaleLen(uint16_t len, float k) {
+  return (uint16_t) (len * k + 0.5f);
+}
+
+void BrightnessTable::Build(const Config &cfg) {
+  full_ = {cfg.rl, cfg.gl, cfg.bl, cfg.rlc, cfg.glc, cfg.blc, 0};
+  br_ = cfg.br;
+  br_auto_ = cfg.br_auto;
+  float lux_f = cfg.br_auto_f * 256;
+  if (lux_f < 0) lux_f = 0;
+  if (lux_f > 0xffff) lux_f = 0xffff;
+  lux_f_ = (uint32_t) lux_f;
+  float gamma = (cfg.gamma > 0 ? cfg.gamma : 1.0f);
+  for (int i = 1; i <= kMaxLevel; i++) {
+    // Level 1 is kMinFactor of the full length, level 100 is the full length.
+    float x = (i - 1) / (float) (kMaxLevel - 1);
+    float k = kMinFactor + (1 - kMinFactor) * powf(x, gamma);
+    BrightnessLevels &lv = lut_[i];
+    lv.rl = ScaleLen(cfg.rl, k);
+    lv.gl = ScaleLen(cfg.gl, k);
+    lv.bl = ScaleLen(cfg.bl, k);
+    lv.rlc = ScaleLen(cfg.rlc, k);
+    lv.glc = ScaleLen(cfg.glc, k);
+    lv.blc = ScaleLen(cfg.blc, k);
+    float dl = cfg.dl_max - i * cfg.dl_f;
+    if (dl < 0) dl = 0;
+    if (dl > 0xffff) dl = 0xffff;
+    lv.dl = (uint16_t) dl;
+  }
+  lut_[0] = lut_[1];
+}
+
+IRAM int BrightnessTable::GetLevel(int32_t lux) const {
+  int level = br_;
+  if (br_auto_ && lux >= 0) {
+    uint32_t l = (lux > 0xffff ? 0xffff : lux);
+    level = (int) std::min<uint32_t>((l * lux_f_) >> 8, kMaxLevel);
+  }
+  if (level < 0) return -1;
+  if (level < 1) level = 1;
+  if (level > kMaxLevel) level = kMaxLevel;
+  return level;
+}
+
+IRAM void BrightnessTable::GetLevels(int level, uint16_t manual_dl,
+                                     BrightnessLevels *lv) const {
+  if (level < 0) {
+    *lv = full_;
+    lv->dl = manual_dl;
+    return;
+  }
+  *lv = lut_[level > kMaxLevel ? kMaxLevel : level];
+}
+
+}  // namespace clk
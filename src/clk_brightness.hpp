@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace clk {
+
+// Pulse lengths for a given brightness level.
+struct BrightnessLevels {
+  uint16_t rl, gl, bl;
+  uint16_t rlc, glc, blc;
+  uint16_t dl;
+};
+
+// Brightness lookup table.
+// Maps brightness level (1 - 100) to pulse lengths, gamma-corrected so that
+// steps are perceptually even. Built from the config when it changes, lookups
+// use no floating point and no config access and are safe to use from ISR.
+class BrightnessTable {
+ public:
+  static constexpr int kMaxLevel = 100;
+
+  struct Config {
+    // Pulse lengths at full brightness.
+    uint16_t rl, gl, bl, rlc, glc, blc;
+    // Fixed brightness level, -1 - full pulse lengths and manual idle time.
+    int br;
+    bool br_auto;
+    // Lux to brightness level conversion factor.
+    float br_auto_f;
+    // Idle time is dl_max - level * dl_f.
+    float dl_max, dl_f;
+    float gamma;
+  };
+
+  void Build(const Config &cfg);
+
+  // Brightness level for the given illuminance, |lux| < 0 - unknown.
+  // Returns 1 - 100 or -1.
+  int GetLevel(int32_t lux) const;
+
+  // Pulse lengths for the |level|. For level -1 returns full lengths
+  // with idle time of |manual_dl|.
+  void GetLevels(int level, uint16_t manual_dl, BrightnessLevels *lv) const;
+
+ private:
+  BrightnessLevels full_ = {};
+  int br_ = -1;
+  bool br_auto_ = false;
+  // Conversion factor, 24.8 fixed point.
+  uint32_t lux_f_ = 0;
+  BrightnessLevels lut_[kMaxLevel + 1] = {};
+};
+
+}  // namespace clk
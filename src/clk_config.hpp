@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include "mgos_event.h"
+
+#define CLK_CFG_EV_BASE MGOS_EVENT_BASE('C', 'F', 'G')
+
+namespace clk {
+
+enum class ConfigEvent {
+  // clock.* config has been changed in memory. Triggered by the code that
+  // changes it, or by the Clock.ConfigChanged RPC after Config.Set.
+  kChanged = CLK_CFG_EV_BASE,
+};
+
+}  // namespace clk
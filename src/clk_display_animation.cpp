@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_display_animation.hpp"
+
+#include <cstring>
+
+namespace clk {
+
+static constexpr int kNumDigits = 5;
+static constexpr uint8_t kEmpty = 0xff;
+
+// Segments by row, top to bottom: horizontal rows have one segment, vertical
+// rows have a left and a right one. Values are bit numbers in the digit value,
+// -1 - none.
+static const int8_t kRowSegs[5][2] = {
+    {7, -1},  // a
+    {2, 6},   // f, b
+    {1, -1},  // g
+    {3, 5},   // e, c
+    {4, -1},  // d
+};
+static constexpr int kNumRows = 5;
+
+// Copy row |src_row| of |src| into row |dst_row| of |*dst|.
+static void CopyRow(uint8_t src, int src_row, uint8_t *dst, int dst_row) {
+  for (int i = 0; i < 2; i++) {
+    int sb = kRowSegs[src_row][i], db = kRowSegs[dst_row][i];
+    if (sb < 0 || db < 0) continue;
+    if ((src & (1 << sb)) == 0) *dst &= ~(1 << db);
+  }
+}
+
+// Digit slid down by |offset| rows, with |next| coming in from above,
+// separated by an empty row.
+static uint8_t SlideDigit(uint8_t d, uint8_t next, int offset) {
+  uint8_t res = kEmpty;
+  for (int r = 0; r < kNumRows; r++) {
+    int sr = r - offset;
+    if (sr >= 0) {
+      CopyRow(d, sr, &res, r);
+    } else if (sr + kNumRows + 1 < kNumRows) {
+      CopyRow(next, sr + kNumRows + 1, &res, r);
+    }
+  }
+  return res;
+}
+
+int GenDisplayAnimationSteps(DisplayAnimationType type, const uint8_t from[5],
+                             const uint8_t to[5], int colon_digit,
+                             DisplayAnimationStep *steps) {
+  bool changed[kNumDigits] = {};
+  bool any_changed = false;
+  for (int i = 0; i < kNumDigits; i++) {
+    changed[i] = (i != colon_digit && from[i] != to[i]);
+    if (changed[i]) any_changed = true;
+  }
+  if (!any_changed) return 0;
+  int num_steps = 0;
+  switch (type) {
+    case DisplayAnimationType::kNone:
+      break;
+    case DisplayAnimationType::kCrossfade:
+      num_steps = 3;
+      for (int s = 0; s < num_steps; s++) {
+        DisplayAnimationStep &st = steps[s];
+        for (int i = 0; i < kNumDigits; i++) {
+          st.digits[i] = (changed[i] ? from[i] : to[i]);
+          st.next[i] = to[i];
+        }
+        st.mix = (s + 1) * 256 / (num_steps + 1);
+      }
+      break;
+    case DisplayAnimationType::kSlide:
+      // Horizontal and vertical rows alternate, move two rows at a time.
+      num_steps = 2;
+      for (int s = 0; s < num_steps; s++) {
+        DisplayAnimationStep &st = steps[s];
+        for (int i = 0; i < kNumDigits; i++) {
+          st.digits[i] =
+              (changed[i] ? SlideDigit(from[i], to[i], (s + 1) * 2) : to[i]);
+        }
+        memcpy(st.next, st.digits, sizeof(st.next));
+        st.mix = 0;
+      }
+      break;
+    case DisplayAnimationType::kBlink:
+      // Off - on - off - on (final frame).
+      num_steps = 3;
+      for (int s = 0; s < num_steps; s++) {
+        DisplayAnimationStep &st = steps[s];
+        for (int i = 0; i < kNumDigits; i++) {
+          st.digits[i] = ((changed[i] && s % 2 == 0) ? kEmpty : to[i]);
+        }
+        memcpy(st.next, st.digits, sizeof(st.next));
+        st.mix = 0;
+      }
+      break;
+  }
+  return num_steps;
+}
+
+}  // namespace clk
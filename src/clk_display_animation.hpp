@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace clk {
+
+enum class DisplayAnimationType {
+  kNone = 0,
+  kCrossfade = 1,
+  kSlide = 2,
+  kBlink = 3,
+};
+
+// One intermediate frame of a transition between two sets of digits.
+// Digits that differ between |digits| and |next| are shown both ways,
+// |mix| (0 - 256) is the share of |next|.
+struct DisplayAnimationStep {
+  uint8_t digits[5];
+  uint8_t next[5];
+  uint16_t mix;
+};
+
+// Maximum number of intermediate steps in a transition.
+static constexpr int kMaxDisplayAnimationSteps = 3;
+
+// Generate intermediate steps of the transition from |from| to |to|,
+// the final frame (|to|) is not included. Digit |colon_digit| is not animated
+// and switches to the new value immediately.
+// Returns the number of steps, 0 if there is nothing to animate.
+int GenDisplayAnimationSteps(DisplayAnimationType type, const uint8_t from[5],
+                             const uint8_t to[5], int colon_digit,
+                             DisplayAnimationStep *steps);
+
+}  // namespace clk
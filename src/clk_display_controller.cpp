@@ -5,12 +5,129 @@
 
 #include "clk_display_controller.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+
 #include "mgos.h"
 
-#include "soc/rmt_reg.h"
+#include "esp32/clk.h"
+#include "esp_timer.h"
+#include "xtensa/hal.h"
 
 namespace clk {
 
+// Precomputed waveforms.
+//
+// Shifting a digit into the registers takes 7 slots of 2 cycles, in each slot
+// SER and QSER present one bit. Level sequence of a line for a given 7-bit
+// pattern does not depend on anything else, so we generate items for all 128
+// patterns at compile time and splice them together when building a frame.
+// Bit N of the pattern is the line level in slot N (1 - 7), bit 0 is unused,
+// same as in the digit values.
+static constexpr uint16_t kShiftLen = 7 * 2;
+// Shifting in zeroes to turn off Q.
+static constexpr uint16_t kClearLen = 5 * 2;
+
+struct SlotSeq {
+  RMTChannel::Item items[7];
+  uint8_t len;
+};
+
+struct SlotSeqTable {
+  SlotSeq seqs[128];
+};
+
+// SRCLK pulses for the shift-in and clear phases.
+struct SrclkSeq {
+  RMTChannel::Item items[kShiftLen + kClearLen];
+};
+
+template <size_t... Is>
+struct IndexSeq {};
+template <size_t N, size_t... Is>
+struct MakeIndexSeq : MakeIndexSeq<N - 1, N - 1, Is...> {};
+template <size_t... Is>
+struct MakeIndexSeq<0, Is...> {
+  typedef IndexSeq<Is...> Type;
+};
+
+static constexpr bool SlotLevel(uint8_t bits, int slot) {
+  return ((bits >> slot) & 1) != 0;
+}
+
+// First slot after the run that |slot| is in.
+static constexpr int RunEnd(uint8_t bits, int slot) {
+  return (slot >= 7 ? 8
+                    : (SlotLevel(bits, slot + 1) != SlotLevel(bits, slot)
+                           ? slot + 1
+                           : RunEnd(bits, slot + 1)));
+}
+
+static constexpr int RunStart(uint8_t bits, int n, int slot = 1) {
+  return ((n == 0 || slot >= 8) ? slot
+                                : RunStart(bits, n - 1, RunEnd(bits, slot)));
+}
+
+static constexpr int NumRuns(uint8_t bits, int slot = 1) {
+  return (slot >= 8 ? 0 : 1 + NumRuns(bits, RunEnd(bits, slot)));
+}
+
+static constexpr RMTChannel::Item MakeItem(int num_cycles, bool val) {
+  return RMTChannel::Item{(uint16_t) num_cycles, (uint16_t) val};
+}
+
+static constexpr RMTChannel::Item MakeSlotItem(uint8_t bits, int start) {
+  return (start >= 8 ? MakeItem(0, false)
+                     : MakeItem((RunEnd(bits, start) - start) * 2,
+                                SlotLevel(bits, start)));
+}
+
+static constexpr SlotSeq MakeSlotSeq(uint8_t bits) {
+  return SlotSeq{{MakeSlotItem(bits, RunStart(bits, 0)),
+                  MakeSlotItem(bits, RunStart(bits, 1)),
+                  MakeSlotItem(bits, RunStart(bits, 2)),
+                  MakeSlotItem(bits, RunStart(bits, 3)),
+                  MakeSlotItem(bits, RunStart(bits, 4)),
+                  MakeSlotItem(bits, RunStart(bits, 5)),
+                  MakeSlotItem(bits, RunStart(bits, 6))},
+                 (uint8_t) NumRuns(bits)};
+}
+
+template <size_t... Is>
+static constexpr SlotSeqTable MakeSlotSeqTable(IndexSeq<Is...>) {
+  return SlotSeqTable{{MakeSlotSeq((uint8_t)(Is << 1))...}};
+}
+
+template <size_t... Is>
+static constexpr SrclkSeq MakeSrclkSeq(IndexSeq<Is...>) {
+  return SrclkSeq{{MakeItem(1, (Is % 2) != 0)...}};
+}
+
+static constexpr SlotSeqTable kSlotSeqs =
+    MakeSlotSeqTable(MakeIndexSeq<128>::Type());
+static constexpr SrclkSeq kSrclkSeq =
+    MakeSrclkSeq(MakeIndexSeq<kShiftLen + kClearLen>::Type());
+
+#if QMAP == 1
+static const uint8_t kDigitQ[DisplayController::kNumDigits] = {1, 2, 5, 3, 4};
+#elif QMAP == 2
+static const uint8_t kDigitQ[DisplayController::kNumDigits] = {4, 3, 0, 2, 1};
+#else
+#error "Q mapping not set"
+#endif
+
+static const SlotSeq &DigitSlotSeq(uint8_t d) {
+  return kSlotSeqs.seqs[(d >> 1) & 0x7f];
+}
+
+static const SlotSeq &QSlotSeq(uint8_t qn, uint8_t d) {
+  uint8_t qbits = (d != DisplayController::kDigitValueEmpty ? ~(1 << (qn + 2))
+                                                           : 0xff);
+  return kSlotSeqs.seqs[(qbits >> 1) & 0x7f];
+}
+
 DisplayController::DisplayController(void(int_handler)())
     : srclk_(RMTOutputChannel(0, SRCLK_GPIO, 1, 0, false /* loop */)),
       ser_(RMTOutputChannel(1, SER_GPIO, 0, 1, false /* loop */)),
@@ -19,6 +136,7 @@ DisplayController::DisplayController(void(int_handler)())
       r_(RMTOutputChannel(4, OE_R_GPIO, 0, 1, false /* loop */)),
       g_(RMTOutputChannel(5, OE_G_GPIO, 0, 1, false /* loop */)),
       b_(RMTOutputChannel(6, OE_B_GPIO, 0, 1, false /* loop */)),
+      set_({&srclk_, &ser_, &qser_, &rclk_, &r_, &g_, &b_}),
       int_handler_(int_handler) {
 }
 
@@ -56,6 +174,7 @@ IRAM void DisplayController::Detach() {
 }
 
 void DisplayController::Clear() {
+  valid_ = false;
   srclk_.Clear();
   ser_.Clear();
   qser_.Clear();
@@ -65,36 +184,29 @@ void DisplayController::Clear() {
   b_.Clear();
 }
 
-void DisplayController::GenDigitSeq(uint8_t qn, uint8_t d, uint16_t len,
-                                    uint16_t rl, uint16_t gl, uint16_t bl,
-                                    uint16_t dl) {
-  // Set up shift registers
-  int qbn = qn + 2;
+void DisplayController::GenDigitSeq(uint8_t qn, uint8_t d, uint16_t rl,
+                                    uint16_t gl, uint16_t bl, uint16_t dl,
+                                    VisitItems *vi) {
+  // Set up shift registers: shift in the digit value and the Q bit, latch,
+  // then shift in zeroes to turn off Q at the end.
   // 5 - 7, 4 - 6, 3 - 5, 2 - 4, 1 - 3,
-  for (int i = 1; i < 8; i++) {
-    // Set bit value in SER
-    ser_.Set((d & (1 << i)) == 0, len * 2);
-    // Set Q value in the Q shift register
-    qser_.Set((i == qbn && d != kDigitValueEmpty), len * 2);
-    // Latch into shift register
-    srclk_.Off(len);
-    srclk_.On(len);
-  }
-  rclk_.OffTo(srclk_);
-  r_.OffTo(srclk_);
-  g_.OffTo(srclk_);
-  b_.OffTo(srclk_);
+  const SlotSeq &ss = DigitSlotSeq(d);
+  const SlotSeq &qs = QSlotSeq(qn, d);
+  srclk_.Append(kSrclkSeq.items, ARRAY_SIZE(kSrclkSeq.items));
+  // SER and QSER segments are not merged with the previous digit so they can
+  // be replaced individually later.
+  ser_.Append(ss.items, ss.len, false /* merge */);
+  ser_.Off(kClearLen);
+  qser_.Append(qs.items, qs.len, false /* merge */);
+  qser_.Off(kClearLen);
+  rclk_.Off(kShiftLen);
+  r_.Off(kShiftLen);
+  g_.Off(kShiftLen);
+  b_.Off(kShiftLen);
   // Latch, activate Q.
-  rclk_.On(len);
-  // Shift in the sequence to turn off Q.
-  for (int i = 0; i < 5; i++) {
-    ser_.Off(len * 2);
-    qser_.Off(len * 2);
-    srclk_.Off(len);
-    srclk_.On(len);
-  }
+  rclk_.On(1);
   // Activate segments.
-  uint16_t max = 0;
+  uint16_t max = kClearLen;
   r_.On(rl);
   if (rl > max) max = rl;
   g_.On(gl);
@@ -102,15 +214,9 @@ void DisplayController::GenDigitSeq(uint8_t qn, uint8_t d, uint16_t len,
   b_.On(bl);
   if (bl > max) max = bl;
   rclk_.Off(max);
-  if (max < 5 * 2) {
-    rclk_.Off(5 * 2 - max);
-  }
-  // Pull everything up to max.
-  r_.OffTo(rclk_);
-  g_.OffTo(rclk_);
-  b_.OffTo(rclk_);
+  uint16_t rclk_win = rclk_.len_ - 1;
   // Turn off Q.
-  rclk_.On(len);
+  rclk_.On(1);
   // Pull everything up.
   r_.OffTo(rclk_);
   g_.OffTo(rclk_);
@@ -120,6 +226,13 @@ void DisplayController::GenDigitSeq(uint8_t qn, uint8_t d, uint16_t len,
   qser_.OffTo(rclk_);
   // Idle sequence.
   GenIdleSeq(dl);
+  if (vi != nullptr) {
+    vi->srclk_tail = srclk_.len_ - 1;
+    vi->rclk_win = rclk_win;
+    vi->r_tail = r_.len_ - 1;
+    vi->g_tail = g_.len_ - 1;
+    vi->b_tail = b_.len_ - 1;
+  }
 }
 
 void DisplayController::GenIdleSeq(uint16_t dl) {
@@ -143,29 +256,39 @@ IRAM void DisplayController::Upload() {
   b_.Upload();
 }
 
-// This is especially time critical: we must kick off all channels as close to
-// simultaneously as possible.
-IRAM void DisplayController::Start() {
-  uint32_t sv1 = srclk_.conf1_start_;
-  uint32_t sv2 = r_.conf1_start_;
-  uint32_t rmt_reg_base = RMT_CH0CONF1_REG;
+IRAM uint32_t DisplayController::frame_len() const {
+  return srclk_.tot_len_;
+}
+
+IRAM void DisplayController::Start(bool loop) {
+  srclk_.ClearInt();
+  // Channels must be started as close to simultaneously as possible.
+  set_.Start(loop);
+  if (loop) {
+    srclk_.DisableInt();
+  } else {
+    srclk_.EnableInt();
+  }
+}
+
+// All channels have the same length and finish the pass together, the end
+// interrupt lets the handler reload and restart them in sync.
+IRAM void DisplayController::StopLoop() {
   srclk_.ClearInt();
-  __asm__ __volatile__(
-      "rsil a8, 15\n"
-      "s32i.n  %[sv1], %[rrb], 0*8\n"
-      "s32i.n  %[sv2], %[rrb], 1*8\n"
-      "s32i.n  %[sv2], %[rrb], 2*8\n"
-      "s32i.n  %[sv1], %[rrb], 3*8\n"
-      "s32i.n  %[sv2], %[rrb], 4*8\n"
-      "s32i.n  %[sv2], %[rrb], 5*8\n"
-      "s32i.n  %[sv2], %[rrb], 6*8\n"
-      "wsr.ps  a8\n"
-      : /* out */
-      : /* in */[rrb] "a"(rmt_reg_base), [sv1] "a"(sv1), [sv2] "a"(sv2)
-      : /* temp */ "a8", "memory");
+  set_.StopLoop();
   srclk_.EnableInt();
 }
 
+IRAM bool DisplayController::CanLoop() const {
+  const RMTOutputChannel *chs[] = {&srclk_, &ser_, &qser_, &rclk_,
+                                   &r_,     &g_,   &b_};
+  for (const RMTOutputChannel *ch : chs) {
+    // Need space for the end marker.
+    if (ch->len_ >= RMTChannel::kMemLen) return false;
+  }
+  return true;
+}
+
 void DisplayController::Dump() {
   srclk_.Dump();
   ser_.Dump();
@@ -180,25 +303,262 @@ void DisplayController::Dump() {
                 r_.tot_len_, g_.len_, g_.tot_len_, b_.len_, b_.tot_len_));
 }
 
-void DisplayController::SetDigits(const uint8_t digits[5], uint16_t rl,
+void DisplayController::SetupModel(DisplayModel *model) const {
+  const RMTOutputChannel *chs[DisplayModel::kNumLines] = {
+      &srclk_, &ser_, &qser_, &rclk_, &r_, &g_, &b_,
+  };
+  for (int i = 0; i < DisplayModel::kNumLines; i++) {
+    model->SetLine(static_cast<DisplayModel::Line>(i), chs[i]->data(),
+                   chs[i]->len(), chs[i]->idle_value_);
+  }
+}
+
+void DisplayController::CopySeqs(const DisplayController &other) {
+  RMTOutputChannel *dst[] = {&srclk_, &ser_, &qser_, &rclk_, &r_, &g_, &b_};
+  const RMTOutputChannel *src[] = {&other.srclk_, &other.ser_, &other.qser_,
+                                   &other.rclk_,  &other.r_,   &other.g_,
+                                   &other.b_};
+  for (size_t i = 0; i < ARRAY_SIZE(dst); i++) {
+    dst[i]->len_ = src[i]->len_;
+    dst[i]->tot_len_ = src[i]->tot_len_;
+    memcpy(dst[i]->data_.items, src[i]->data_.items,
+           src[i]->len_ * sizeof(RMTChannel::Item));
+  }
+}
+
+// Binary-weighted slice |b| out of |n| of the value |v|.
+// Slices add up to |v|.
+IRAM static uint16_t BCMSlice(uint16_t v, int b, int n) {
+  if (n <= 1) return v;
+  uint32_t div = (1U << n) - 1;
+  return (v * ((2U << b) - 1) / div) - (v * ((1U << b) - 1) / div);
+}
+
+bool DisplayController::SetDigits(const uint8_t digits[5], uint16_t rl,
                                   uint16_t gl, uint16_t bl, uint16_t rlc,
-                                  uint16_t glc, uint16_t blc, uint16_t dl) {
+                                  uint16_t glc, uint16_t blc, uint16_t dl,
+                                  uint8_t num_planes) {
+  if (num_planes < 1) num_planes = 1;
+  if (num_planes > kMaxPlanes) num_planes = kMaxPlanes;
+  if (!valid_ || rl != rl_ || gl != gl_ || bl != bl_ || rlc != rlc_ ||
+      glc != glc_ || blc != blc_ || dl != dl_ || num_planes != num_planes_) {
+    // Levels affect every digit, regenerate everything.
+    // With BCM, every digit is visited once per bit plane with the on time
+    // and idle time of the plane's slice.
+    Clear();
+    int v = 0;
+    for (int b = 0; b < num_planes; b++) {
+      for (int i = 0; i < kNumDigits; i++, v++) {
+        bool colon = (i == kColonDigit);
+        ser_pos_[v] = ser_.len_;
+        qser_pos_[v] = qser_.len_;
+        GenDigitSeq(kDigitQ[i], digits[i],
+                    BCMSlice((colon ? rlc : rl), b, num_planes),
+                    BCMSlice((colon ? glc : gl), b, num_planes),
+                    BCMSlice((colon ? blc : bl), b, num_planes),
+                    BCMSlice(dl, b, num_planes), &visit_items_[v]);
+      }
+    }
+    ser_pos_[v] = ser_.len_;
+    qser_pos_[v] = qser_.len_;
+    memcpy(digits_, digits, sizeof(digits_));
+    rl_ = rl;
+    gl_ = gl;
+    bl_ = bl;
+    rlc_ = rlc;
+    glc_ = glc;
+    blc_ = blc;
+    dl_ = dl;
+    num_planes_ = num_planes;
+    GetLevels(&cur_);
+    valid_ = true;
+    return true;
+  }
+  // Only SER and QSER depend on the digit value, replace just those segments.
+  bool changed = false;
+  for (int i = 0; i < kNumDigits; i++) {
+    uint8_t d = digits[i], od = digits_[i];
+    if (d == od) continue;
+    const SlotSeq &ss = DigitSlotSeq(d);
+    const SlotSeq &qs = QSlotSeq(kDigitQ[i], d);
+    bool q_changed = ((d == kDigitValueEmpty) != (od == kDigitValueEmpty));
+    for (int v = i; v < num_planes_ * kNumDigits; v += kNumDigits) {
+      SpliceSlotSeq(&ser_, ser_pos_, v, ss.items, ss.len);
+      if (q_changed) SpliceSlotSeq(&qser_, qser_pos_, v, qs.items, qs.len);
+    }
+    digits_[i] = d;
+    changed = true;
+  }
+  return changed;
+}
+
+bool DisplayController::HasDigits(const uint8_t digits[5], uint16_t rl,
+                                  uint16_t gl, uint16_t bl, uint16_t rlc,
+                                  uint16_t glc, uint16_t blc, uint16_t dl,
+                                  uint8_t num_planes) const {
+  if (num_planes < 1) num_planes = 1;
+  if (num_planes > kMaxPlanes) num_planes = kMaxPlanes;
+  return (valid_ && memcmp(digits, digits_, sizeof(digits_)) == 0 &&
+          rl == rl_ && gl == gl_ && bl == bl_ && rlc == rlc_ && glc == glc_ &&
+          blc == blc_ && dl == dl_ && num_planes == num_planes_);
+}
+
+void DisplayController::SetMixedDigits(const uint8_t digits[5],
+                                       const uint8_t next[5], uint16_t mix,
+                                       uint16_t rl, uint16_t gl, uint16_t bl,
+                                       uint16_t rlc, uint16_t glc,
+                                       uint16_t blc, uint16_t dl) {
   Clear();
-#if QMAP == 1
-  GenDigitSeq(1, digits[0], 1, rl, gl, bl, dl);
-  GenDigitSeq(2, digits[1], 1, rl, gl, bl, dl);
-  GenDigitSeq(5, digits[2], 1, rlc, glc, blc, dl);
-  GenDigitSeq(3, digits[3], 1, rl, gl, bl, dl);
-  GenDigitSeq(4, digits[4], 1, rl, gl, bl, dl);
-#elif QMAP == 2
-  GenDigitSeq(4, digits[0], 1, rl, gl, bl, dl);
-  GenDigitSeq(3, digits[1], 1, rl, gl, bl, dl);
-  GenDigitSeq(0, digits[2], 1, rlc, glc, blc, dl);
-  GenDigitSeq(2, digits[3], 1, rl, gl, bl, dl);
-  GenDigitSeq(1, digits[4], 1, rl, gl, bl, dl);
-#else
-#error "Q mapping not set"
-#endif
+  for (int i = 0; i < kNumDigits; i++) {
+    bool colon = (i == kColonDigit);
+    uint16_t r = (colon ? rlc : rl), g = (colon ? glc : gl),
+             b = (colon ? blc : bl);
+    if (digits[i] == next[i] || mix == 0) {
+      GenDigitSeq(kDigitQ[i], digits[i], r, g, b, dl);
+      continue;
+    }
+    uint16_t rn = r * mix / 256, gn = g * mix / 256, bn = b * mix / 256;
+    GenDigitSeq(kDigitQ[i], digits[i], r - rn, g - gn, b - bn, dl);
+    GenDigitSeq(kDigitQ[i], next[i], rn, gn, bn, dl);
+  }
+}
+
+const uint8_t *DisplayController::digits() const {
+  return digits_;
+}
+
+IRAM void DisplayController::GetLevels(BrightnessLevels *lv) const {
+  lv->rl = rl_;
+  lv->gl = gl_;
+  lv->bl = bl_;
+  lv->rlc = rlc_;
+  lv->glc = glc_;
+  lv->blc = blc_;
+  lv->dl = dl_;
+}
+
+IRAM static bool SameLevels(const BrightnessLevels &a,
+                            const BrightnessLevels &b) {
+  return (a.rl == b.rl && a.gl == b.gl && a.bl == b.bl && a.rlc == b.rlc &&
+          a.glc == b.glc && a.blc == b.blc && a.dl == b.dl);
+}
+
+// Pulse length for the slice |b| of level |l| in a visit generated with
+// level |gl|. Pulse that was not generated has no item and stays empty,
+// one that was cannot become empty: zero length item ends the sequence.
+IRAM static uint16_t PatchedPulse(uint16_t gl, uint16_t l, int b, int n) {
+  if (BCMSlice(gl, b, n) == 0) return 0;
+  return std::max<uint16_t>(BCMSlice(l, b, n), 1);
+}
+
+// static
+IRAM bool DisplayController::AdjustItem(RMTOutputChannel *ch, size_t i,
+                                        int32_t delta, bool apply) {
+  if (delta == 0) return true;
+  // Item must not become an end marker or overflow.
+  int32_t nc = (int32_t) ch->data_.items[i].num_cycles + delta;
+  if (nc < 1 || nc > 0x7fff) return false;
+  if (!apply) return true;
+  ch->data_.items[i].num_cycles = nc;
+  ch->tot_len_ += delta;
+  ch->MarkDirty(i);
+  return true;
+}
+
+// Each visit is changed independently. Pulses start at the same time and
+// after them all the lines are off until the next visit except for the RCLK
+// pulse that turns off Q. Pulse length changes are offset by the item after
+// the pulse, window and idle length changes are added to the item that spans
+// them in each line. In RCLK these are separate items, the window and the
+// idle after the Q off pulse. The last visit may have no idle item, in which
+// case the idle is added to the window: the digit is dark either way.
+// No visit shares an item with another, so each adjustment can be checked
+// on its own.
+IRAM bool DisplayController::PatchVisits(const BrightnessLevels &lv,
+                                         bool apply) {
+  const int n = num_planes_;
+  bool ok = true;
+  for (int v = 0; v < n * kNumDigits && ok; v++) {
+    const int b = v / kNumDigits;
+    const bool colon = (v % kNumDigits == kColonDigit);
+    const VisitItems &vi = visit_items_[v];
+    RMTOutputChannel *const oe[3] = {&r_, &g_, &b_};
+    const uint16_t oe_tail[3] = {vi.r_tail, vi.g_tail, vi.b_tail};
+    const uint16_t gen[3] = {(colon ? rlc_ : rl_), (colon ? glc_ : gl_),
+                             (colon ? blc_ : bl_)};
+    const uint16_t cur[3] = {(colon ? cur_.rlc : cur_.rl),
+                             (colon ? cur_.glc : cur_.gl),
+                             (colon ? cur_.blc : cur_.bl)};
+    const uint16_t next[3] = {(colon ? lv.rlc : lv.rl),
+                              (colon ? lv.glc : lv.gl),
+                              (colon ? lv.blc : lv.bl)};
+    int32_t pd[3], cw = kClearLen, nw = kClearLen;
+    for (int c = 0; c < 3; c++) {
+      int32_t cp = PatchedPulse(gen[c], cur[c], b, n);
+      int32_t np = PatchedPulse(gen[c], next[c], b, n);
+      cw = std::max(cw, cp);
+      nw = std::max(nw, np);
+      pd[c] = np - cp;
+    }
+    const int32_t wd = nw - cw;
+    const int32_t dd =
+        (int32_t) BCMSlice(lv.dl, b, n) - BCMSlice(cur_.dl, b, n);
+    for (int c = 0; c < 3; c++) {
+      if (pd[c] != 0) ok &= AdjustItem(oe[c], oe_tail[c] - 1, pd[c], apply);
+      ok &= AdjustItem(oe[c], oe_tail[c], wd + dd - pd[c], apply);
+    }
+    ok &= AdjustItem(&srclk_, vi.srclk_tail, wd + dd, apply);
+    ok &= AdjustItem(&ser_, ser_pos_[v + 1] - 1, wd + dd, apply);
+    ok &= AdjustItem(&qser_, qser_pos_[v + 1] - 1, wd + dd, apply);
+    if (vi.rclk_win + 2U < rclk_.len_) {
+      ok &= AdjustItem(&rclk_, vi.rclk_win, wd, apply);
+      ok &= AdjustItem(&rclk_, vi.rclk_win + 2, dd, apply);
+    } else {
+      ok &= AdjustItem(&rclk_, vi.rclk_win, wd + dd, apply);
+    }
+  }
+  return ok;
+}
+
+IRAM bool DisplayController::PatchLevels(const BrightnessLevels &lv) {
+  if (!valid_) return false;
+  if (SameLevels(lv, cur_)) return true;
+  // Nothing is changed unless every item stays in range.
+  if (!PatchVisits(lv, false /* apply */)) return false;
+  PatchVisits(lv, true /* apply */);
+  cur_ = lv;
+  return true;
+}
+
+// Replace segment |i| of a SER or QSER channel with a new slot sequence
+// followed by idle level, keeping segment duration the same.
+void DisplayController::SpliceSlotSeq(RMTOutputChannel *ch, uint16_t *pos,
+                                      int i, const RMTChannel::Item *seq,
+                                      size_t seq_len) {
+  RMTChannel::Item items[ARRAY_SIZE(SlotSeq().items) + 5];
+  const bool idle = !ch->on_value_;
+  uint32_t tail = 0;
+  for (uint16_t j = pos[i]; j < pos[i + 1]; j++) {
+    tail += ch->data_.items[j].num_cycles;
+  }
+  tail -= kShiftLen;
+  size_t n = seq_len;
+  memcpy(items, seq, n * sizeof(items[0]));
+  while (tail > 0 && n < ARRAY_SIZE(items)) {
+    RMTChannel::Item &last = items[n - 1];
+    if (last.val == idle && last.num_cycles < 0x7fff) {
+      uint32_t nc = std::min<uint32_t>(0x7fff - last.num_cycles, tail);
+      last.num_cycles += nc;
+      tail -= nc;
+    } else {
+      items[n++] = MakeItem(0, idle);
+    }
+  }
+  size_t old_n = pos[i + 1] - pos[i];
+  if (!ch->Splice(pos[i], old_n, items, n)) return;
+  for (int j = i + 1; j <= num_planes_ * kNumDigits; j++) {
+    pos[j] = pos[j] + n - old_n;
+  }
 }
 
 // static
@@ -207,59 +567,413 @@ IRAM void DisplayController::ChannelIntHandler(RMTChannel *ch, void *arg) {
   ctl->int_handler_();
 }
 
-// Two controllers: one is active, the other is inactive and can be updated.
-extern DisplayController s_ctls[2];
+// Three controllers, used as a triple buffer:
+//  * front is being displayed, owned by the interrupt handler;
+//  * back is owned by the writer (SetDisplayDigits);
+//  * the third one is in the middle slot, exchanged atomically.
+// Writer publishes a complete frame by swapping back with the middle slot
+// and setting the fresh flag, interrupt handler picks it up by swapping front
+// with the middle slot. Neither side ever waits for the other and the
+// handler always gets the newest published frame.
+extern DisplayController s_ctls[3];
 bool s_started = false;
-static bool s_switch_ctl = false;
-static int s_active_ctl = 0;
+static constexpr int kCtlIdxMask = 0x3;
+static constexpr int kCtlFresh = 0x4;
+static std::atomic<int> s_middle_ctl{1};
+static int s_front_ctl = 0;
+static int s_back_ctl = 2;
+// Last frame published by the writer, writer only.
+static int s_last_ctl = 0;
+// Currently attached controller, interrupt handler only.
+static DisplayController *s_cur_ctl = nullptr;
+// Frame of controller N is not to be shown until this time (low 32 bits
+// of esp_timer_get_time()). Set by the writer before publishing.
+static uint32_t s_ctl_show_at_us[3] = {};
+static bool s_ctl_show_at[3] = {};
+
+// Transition animation.
+// Intermediate frames are pre-generated by the writer and attached to the
+// controller being published, interrupt handler plays them before showing
+// that controller, each for |step_len| refresh cycles.
+// There is only one set of frames: while it is in use (published or being
+// played), new frames are published without animation.
+struct DisplayAnimation {
+  DisplayAnimationType type = DisplayAnimationType::kNone;
+  int step_len = 1;
+  int num_frames = 0;
+  std::unique_ptr<DisplayController> frames[kMaxDisplayAnimationSteps];
+};
+static DisplayAnimation *s_anim = nullptr;
+static std::atomic<bool> s_anim_busy{false};
+// Controller N has the animation attached, set by the writer before
+// publishing.
+static bool s_ctl_anim[3] = {};
+// Playback state, interrupt handler only. Frame -1 - not playing.
+static int s_anim_frame = -1;
+static int s_anim_refresh = 0;
+
+// Brightness ramp. When the front frame has different levels than the ones
+// being shown, the handler patches it to move from the shown levels to its own
+// over |s_ramp_frames| refresh cycles. Animation frames are shown as
+// generated and pause the ramp.
+static std::atomic<int> s_ramp_frames{0};
+// Ramp state, interrupt handler only.
+static bool s_ramp_started = false;
+static BrightnessLevels s_ramp_from = {}, s_ramp_to = {}, s_shown_lv = {};
+static int s_ramp_step = 0, s_ramp_len = 0;
+// Incremented by the handler before and after patching the frame, odd while
+// patching. Readers of the sequences outside of the handler copy them and
+// retry if it has changed in the meantime.
+static std::atomic<uint32_t> s_patch_seq{0};
+
+// Unchanged frames are looped by the peripheral, the handler only runs when
+// the writer stops the loop to switch to a new frame.
+static std::atomic<bool> s_loop_enabled{false};
+// Current frame is looping.
+static std::atomic<bool> s_looping{false};
+
+// Updated by the interrupt handler, except for num_missed_swaps which is
+// counted by the writer in s_num_missed_swaps. Same as s_patch_seq,
+// s_stats_seq is odd while the handler updates the stats.
+static DisplayStats s_stats = {};
+static std::atomic<uint32_t> s_stats_seq{0};
+static std::atomic<bool> s_reset_stats{false};
+static uint32_t s_num_missed_swaps = 0;
+static uint32_t s_last_frame_start = 0;
+
+// |frame_len| is the length of the frame that has just finished, ticks.
+IRAM static void UpdateStats(uint32_t frame_len, uint32_t entry,
+                             uint32_t start, uint32_t end,
+                             uint32_t upload_cycles, bool swap, bool loop) {
+  DisplayStats *st = &s_stats;
+  uint32_t seq = s_stats_seq.load(std::memory_order_relaxed);
+  s_stats_seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  if (s_reset_stats.exchange(false)) {
+    uint32_t cpu_mhz = st->cpu_mhz;
+    memset(st, 0, sizeof(*st));
+    st->cpu_mhz = cpu_mhz;
+  }
+  st->num_frames++;
+  if (swap) st->num_swaps++;
+  if (loop) st->num_loops++;
+  uint32_t rc = end - start;
+  st->restart_cycles_last = rc;
+  if (rc > st->restart_cycles_max) st->restart_cycles_max = rc;
+  st->restart_cycles_sum += rc;
+  st->upload_cycles_last = upload_cycles;
+  if (upload_cycles > st->upload_cycles_max) {
+    st->upload_cycles_max = upload_cycles;
+  }
+  st->upload_cycles_sum += upload_cycles;
+  uint32_t dc = start - entry;
+  st->dispatch_cycles_last = dc;
+  if (dc > st->dispatch_cycles_max) st->dispatch_cycles_max = dc;
+  st->dispatch_cycles_sum += dc;
+  if (s_last_frame_start != 0) {
+    // Period of the frame that has just finished, compare to its length.
+    uint32_t pc = end - s_last_frame_start;
+    st->period_cycles_sum += pc;
+    st->num_periods++;
+    uint32_t nom = frame_len * st->cpu_mhz;
+    uint32_t dev = (pc > nom ? pc - nom : nom - pc) / st->cpu_mhz;
+    // Frame should have ended at s_last_frame_start + nom.
+    int32_t lc = (int32_t) (entry - (s_last_frame_start + nom));
+    if (lc < 0) lc = 0;
+    st->latency_cycles_last = lc;
+    if ((uint32_t) lc > st->latency_cycles_max) st->latency_cycles_max = lc;
+    st->latency_cycles_sum += lc;
+    int bucket = (dev == 0 ? 0 : 32 - __builtin_clz(dev));
+    if (bucket >= DisplayStats::kNumJitterBuckets) {
+      bucket = DisplayStats::kNumJitterBuckets - 1;
+    }
+    st->jitter_hist[bucket]++;
+  }
+  // Length of a looped frame is not known.
+  s_last_frame_start = (loop ? 0 : end);
+  s_stats_seq.store(seq + 2, std::memory_order_release);
+}
+
+IRAM static void StopAnimation() {
+  s_anim_frame = -1;
+  s_anim_busy.store(false, std::memory_order_release);
+}
+
+// Animation frame to show next, nullptr when done.
+IRAM static DisplayController *NextAnimationFrame() {
+  if (s_anim_refresh >= s_anim->step_len) {
+    s_anim_frame++;
+    s_anim_refresh = 0;
+  }
+  if (s_anim_frame >= s_anim->num_frames) {
+    StopAnimation();
+    return nullptr;
+  }
+  s_anim_refresh++;
+  return s_anim->frames[s_anim_frame].get();
+}
+
+IRAM static uint16_t RampLevel(uint16_t from, uint16_t to, int step,
+                               int len) {
+  return from + ((int32_t) to - from) * step / len;
+}
+
+// Bring levels of the front frame one step closer to its own.
+// Returns true if the ramp is not done yet.
+IRAM static bool StepBrightnessRamp(DisplayController *ctl) {
+  BrightnessLevels to;
+  ctl->GetLevels(&to);
+  if (!s_ramp_started || !SameLevels(to, s_ramp_to)) {
+    s_ramp_from = (s_ramp_started ? s_shown_lv : to);
+    s_ramp_to = to;
+    s_ramp_step = 0;
+    s_ramp_len = s_ramp_frames.load(std::memory_order_relaxed);
+    s_ramp_started = true;
+  }
+  BrightnessLevels lv = to;
+  if (s_ramp_step < s_ramp_len) {
+    const BrightnessLevels &f = s_ramp_from;
+    int st = ++s_ramp_step, len = s_ramp_len;
+    lv.rl = RampLevel(f.rl, to.rl, st, len);
+    lv.gl = RampLevel(f.gl, to.gl, st, len);
+    lv.bl = RampLevel(f.bl, to.bl, st, len);
+    lv.rlc = RampLevel(f.rlc, to.rlc, st, len);
+    lv.glc = RampLevel(f.glc, to.glc, st, len);
+    lv.blc = RampLevel(f.blc, to.blc, st, len);
+    lv.dl = RampLevel(f.dl, to.dl, st, len);
+  }
+  uint32_t seq = s_patch_seq.load(std::memory_order_relaxed);
+  s_patch_seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  if (!ctl->PatchLevels(lv)) {
+    // Levels are out of the range the frame can be patched to. Restore it
+    // as it was generated, this always fits.
+    lv = to;
+    s_ramp_step = s_ramp_len;
+    ctl->PatchLevels(lv);
+  }
+  s_patch_seq.store(seq + 2, std::memory_order_release);
+  s_shown_lv = lv;
+  return (s_ramp_step < s_ramp_len);
+}
 
 IRAM void DisplayIntHandler() {
+  uint32_t start = xthal_get_ccount();
 #ifdef DISPLAY_DEBUG_GPIO
   mgos_gpio_toggle(DISPLAY_DEBUG_GPIO);
 #endif
   RMT.int_clr.ch0_tx_end = true;
-  DisplayController *ctl = &s_ctls[s_active_ctl];
-  if (s_switch_ctl) {
-    ctl->Detach();
-    s_active_ctl ^= 1;
-    ctl = &s_ctls[s_active_ctl];
+  s_looping = false;
+  DisplayController *prev_ctl = s_cur_ctl;
+  // Ramp may patch the same frame before it is restarted.
+  uint32_t prev_len = prev_ctl->frame_len();
+  int m = s_middle_ctl.load(std::memory_order_acquire);
+  bool fresh = false, held = false;
+  while (m & kCtlFresh) {
+    // Scheduled frame is held back until its time, checked on every refresh.
+    int idx = (m & kCtlIdxMask);
+    held = (s_ctl_show_at[idx] &&
+            (int32_t) ((uint32_t) esp_timer_get_time() -
+                       s_ctl_show_at_us[idx]) < 0);
+    if (held) break;
+    // Only take the frame that has been checked. If the writer has published
+    // another one in the meantime, check that one.
+    if (s_middle_ctl.compare_exchange_weak(m, s_front_ctl,
+                                           std::memory_order_acquire)) {
+      fresh = true;
+      break;
+    }
+  }
+  if (fresh) {
+    s_front_ctl = (m & kCtlIdxMask);
+    // New frame interrupts the animation that is playing, if any.
+    if (s_anim_frame >= 0) StopAnimation();
+    if (s_ctl_anim[s_front_ctl]) {
+      s_anim_frame = 0;
+      s_anim_refresh = 0;
+    }
+  }
+  DisplayController *ctl = &s_ctls[s_front_ctl];
+  if (s_anim_frame >= 0) {
+    DisplayController *af = NextAnimationFrame();
+    if (af != nullptr) ctl = af;
+  }
+  bool ramp = (s_anim_frame < 0 && StepBrightnessRamp(ctl));
+  if (ctl != prev_ctl) {
+    prev_ctl->Detach();
     ctl->Attach();
-    s_switch_ctl = false;
+    s_cur_ctl = ctl;
   }
+  bool loop = (s_loop_enabled && s_anim_frame < 0 && !held && !ramp &&
+               ctl->CanLoop());
+  uint32_t upload_start = xthal_get_ccount();
   ctl->Upload();
-  ctl->Start();
+  uint32_t upload_cycles = xthal_get_ccount() - upload_start;
+  ctl->Start(loop);
+  UpdateStats(prev_len, RMTChannel::int_entry_ccount(), start,
+              xthal_get_ccount(), upload_cycles, fresh, loop);
+  if (loop) {
+    s_looping = true;
+    // Writer may have published a frame after we checked but before the flag
+    // was set, in which case it did not stop the loop.
+    if (s_middle_ctl.load() & kCtlFresh) ctl->StopLoop();
+  }
 #ifdef DISPLAY_DEBUG_GPIO
   mgos_gpio_toggle(DISPLAY_DEBUG_GPIO);
 #endif
 }
 
-DisplayController s_ctls[2] = {DisplayController(DisplayIntHandler),
+DisplayController s_ctls[3] = {DisplayController(DisplayIntHandler),
+                               DisplayController(DisplayIntHandler),
                                DisplayController(DisplayIntHandler)};
 
 void SetDisplayDigits(const uint8_t digits[5], uint16_t rl, uint16_t gl,
                       uint16_t bl, uint16_t rlc, uint16_t glc, uint16_t blc,
-                      uint16_t dl) {
-  s_switch_ctl = false;
+                      uint16_t dl, uint8_t num_planes, int64_t show_at_us) {
   if (!s_started) {
-    s_ctls[0].Init();
-    s_ctls[1].Init();
+    for (DisplayController &ctl : s_ctls) ctl.Init();
+    s_stats.cpu_mhz = esp_clk_cpu_freq() / 1000000;
 #ifdef DISPLAY_DEBUG_GPIO
     mgos_gpio_setup_output(DISPLAY_DEBUG_GPIO, 0);
 #endif
   }
-  int inactive_ctl = (s_active_ctl ^ 1);
-  DisplayController *ctl = &s_ctls[inactive_ctl];
-  ctl->SetDigits(digits, rl, gl, bl, rlc, glc, blc, dl);
+  // Nothing to do if the last frame we handed over already has these.
+  if (s_started && s_ctls[s_last_ctl].HasDigits(digits, rl, gl, bl, rlc, glc,
+                                                blc, dl, num_planes)) {
+    return;
+  }
+  // Pre-generate the transition from the last published frame, unless the
+  // previous one is still in use.
+  bool anim = false;
+  if (s_started && s_anim != nullptr && !s_anim_busy.load()) {
+    DisplayAnimationStep steps[kMaxDisplayAnimationSteps];
+    s_anim->num_frames = GenDisplayAnimationSteps(
+        s_anim->type, s_ctls[s_last_ctl].digits(), digits,
+        DisplayController::kColonDigit, steps);
+    for (int i = 0; i < s_anim->num_frames; i++) {
+      const DisplayAnimationStep &st = steps[i];
+      s_anim->frames[i]->SetMixedDigits(st.digits, st.next, st.mix, rl, gl, bl,
+                                        rlc, glc, blc, dl);
+    }
+    anim = (s_anim->num_frames > 0);
+  }
+  DisplayController *ctl = &s_ctls[s_back_ctl];
+  // Back controller remembers what it had, only changes are regenerated.
+  ctl->SetDigits(digits, rl, gl, bl, rlc, glc, blc, dl, num_planes);
+  s_last_ctl = s_back_ctl;
 
   if (!s_started) {
-    s_active_ctl = inactive_ctl;
+    // Interrupt handler is not running yet, make it the front directly.
+    std::swap(s_front_ctl, s_back_ctl);
+    s_cur_ctl = ctl;
+    bool loop = (s_loop_enabled && ctl->CanLoop());
     ctl->Upload();
     ctl->Attach();
-    ctl->Start();
+    ctl->Start(loop);
+    s_looping = loop;
     s_started = true;
   } else {
-    s_switch_ctl = true;
+    s_ctl_anim[s_back_ctl] = anim;
+    if (anim) s_anim_busy.store(true);
+    s_ctl_show_at_us[s_back_ctl] = (uint32_t) show_at_us;
+    s_ctl_show_at[s_back_ctl] = (show_at_us != 0);
+    int m = s_middle_ctl.exchange(s_back_ctl | kCtlFresh);
+    s_back_ctl = (m & kCtlIdxMask);
+    // Looping frame does not end by itself. Channels are the same for all
+    // the controllers, this stops the one being displayed.
+    if (s_looping) ctl->StopLoop();
+    if (m & kCtlFresh) {
+      // Previous frame has not been picked up and has been superseded.
+      s_num_missed_swaps++;
+      // Its animation never started and the frames are free again.
+      if (s_ctl_anim[s_back_ctl]) s_anim_busy.store(false);
+    }
+  }
+}
+
+void SetDisplayLoop(bool enable) {
+  s_loop_enabled = enable;
+  if (!enable && s_looping) s_ctls[s_last_ctl].StopLoop();
+}
+
+void SetDisplayBrightnessRamp(int num_frames) {
+  s_ramp_frames = std::max(num_frames, 0);
+}
+
+void SetDisplayAnimation(DisplayAnimationType type, int step_len) {
+  if (type == DisplayAnimationType::kNone) {
+    // Frames are kept: the interrupt handler may still be playing them.
+    if (s_anim != nullptr) s_anim->type = type;
+    return;
+  }
+  if (s_anim == nullptr) {
+    s_anim = new DisplayAnimation();
+    for (auto &f : s_anim->frames) {
+      f.reset(new DisplayController(DisplayIntHandler));
+    }
+  }
+  s_anim->type = type;
+  s_anim->step_len = std::max(step_len, 1);
+}
+
+void GetDisplayStats(DisplayStats *stats, bool reset) {
+  // Stats are updated once per frame, retry if that happened while copying.
+  // After a few tries take what we have, it's only statistics.
+  for (int i = 0; i < 10; i++) {
+    uint32_t seq = s_stats_seq.load(std::memory_order_acquire);
+    *stats = s_stats;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((seq & 1) == 0 &&
+        s_stats_seq.load(std::memory_order_relaxed) == seq) {
+      break;
+    }
+  }
+  stats->num_missed_swaps = s_num_missed_swaps;
+  if (reset) {
+    s_num_missed_swaps = 0;
+    s_reset_stats = true;
+  }
+}
+
+bool CheckDisplay(DisplayModel::Result *res) {
+  if (!s_started) return false;
+  // The frame may be the one being shown, and patched by the interrupt
+  // handler during a brightness ramp. Take a consistent copy. Patching is
+  // done once per refresh cycle, much less often than it takes to copy.
+  std::unique_ptr<DisplayController> ctl(new DisplayController(nullptr));
+  bool ok = false;
+  for (int i = 0; i < 10 && !ok; i++) {
+    uint32_t seq = s_patch_seq.load(std::memory_order_acquire);
+    ctl->CopySeqs(s_ctls[s_last_ctl]);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ok = ((seq & 1) == 0 &&
+          s_patch_seq.load(std::memory_order_relaxed) == seq);
+  }
+  if (!ok) return false;
+  DisplayModel model;
+  ctl->SetupModel(&model);
+  model.Run(res);
+  return true;
+}
+
+void BenchSetDigits(int num_iter, int64_t *full_us, int64_t *incr_us) {
+  std::unique_ptr<DisplayController> ctl(new DisplayController(nullptr));
+  uint8_t digits[5] = {0x9f, 0x25, DisplayController::kDigitValueColon, 0x0d,
+                       0x99};
+  const uint8_t last_digits[2] = {0x99, 0x49};
+  int64_t start = mgos_uptime_micros();
+  for (int i = 0; i < num_iter; i++) {
+    digits[4] = last_digits[i % 2];
+    ctl->Clear();
+    ctl->SetDigits(digits, 0, 1500, 0, 0, 1000, 0, 800);
+  }
+  *full_us = mgos_uptime_micros() - start;
+  start = mgos_uptime_micros();
+  for (int i = 0; i < num_iter; i++) {
+    digits[4] = last_digits[i % 2];
+    ctl->SetDigits(digits, 0, 1500, 0, 0, 1000, 0, 800);
   }
+  *incr_us = mgos_uptime_micros() - start;
 }
 
 }  // namespace clk
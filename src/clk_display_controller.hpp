@@ -7,7 +7,11 @@
 
 #include <cstdint>
 
+#include "clk_brightness.hpp"
+#include "clk_display_animation.hpp"
+#include "clk_display_model.hpp"
 #include "clk_rmt_output_channel.hpp"
+#include "clk_rmt_output_channel_set.hpp"
 
 namespace clk {
 
@@ -18,35 +22,172 @@ class DisplayController {
 
   void Init();
 
+  static constexpr int kNumDigits = 5;
+  static constexpr int kColonDigit = 2;
+  // Maximum number of bit planes for BCM.
+  static constexpr int kMaxPlanes = 4;
   static constexpr uint8_t kDigitValueEmpty = 0b11111111;
   static constexpr uint8_t kDigitValueColon = 0b10101111;
 
-  void SetDigits(const uint8_t digits[5], uint16_t rl, uint16_t gl, uint16_t bl,
-                 uint16_t rlc, uint16_t glc, uint16_t blc, uint16_t dl);
+  // Generate sequences for the given digits and levels.
+  // If the controller already has a sequence with the same levels, only
+  // the digits that changed are regenerated. Returns false if nothing changed.
+  // With |num_planes| > 1, on time of each digit is split into that many
+  // binary-weighted slices interleaved across the frame (BCM), otherwise
+  // each digit gets a single pulse.
+  bool SetDigits(const uint8_t digits[5], uint16_t rl, uint16_t gl, uint16_t bl,
+                 uint16_t rlc, uint16_t glc, uint16_t blc, uint16_t dl,
+                 uint8_t num_planes = 1);
+  bool HasDigits(const uint8_t digits[5], uint16_t rl, uint16_t gl, uint16_t bl,
+                 uint16_t rlc, uint16_t glc, uint16_t blc, uint16_t dl,
+                 uint8_t num_planes = 1) const;
+
+  // Generate a transition frame: digits that differ between |digits| and
+  // |next| are shown twice, |mix| (0 - 256) is the share of |next|.
+  // Incremental updates are not possible after this.
+  void SetMixedDigits(const uint8_t digits[5], const uint8_t next[5],
+                      uint16_t mix, uint16_t rl, uint16_t gl, uint16_t bl,
+                      uint16_t rlc, uint16_t glc, uint16_t blc, uint16_t dl);
+
+  // Digits set by the last SetDigits.
+  const uint8_t *digits() const;
+
+  // Levels set by the last SetDigits.
+  void GetLevels(BrightnessLevels *lv) const;
+
+  // Change pulse and idle lengths of the sequences generated by SetDigits
+  // to |lv| by adjusting the items in place, without regenerating anything.
+  // Timing of the frame changes but it stays the same for all the lines.
+  // Pulses that were generated empty remain so. The frame is still
+  // considered to have the levels it was generated with.
+  // Returns false for frames built by SetMixedDigits and if an item would
+  // get out of range, in which case the frame is left as it was. Levels the
+  // frame was generated with can always be restored.
+  bool PatchLevels(const BrightnessLevels &lv);
 
   // Data generation functions.
   void Clear();
-  void GenDigitSeq(uint8_t qn, uint8_t d, uint16_t len, uint16_t rl,
-                   uint16_t gl, uint16_t bl, uint16_t dl);
+  // Items of a digit visit that PatchLevels adjusts: the window during which
+  // the digit is on in RCLK and the item the visit ends with in the other
+  // lines. In the OE lines, the one before it is the pulse, if any.
+  // SER and QSER segments end at the next visit's position.
+  struct VisitItems {
+    uint16_t srclk_tail, rclk_win, r_tail, g_tail, b_tail;
+  };
+  void GenDigitSeq(uint8_t qn, uint8_t d, uint16_t rl, uint16_t gl,
+                   uint16_t bl, uint16_t dl, VisitItems *vi = nullptr);
   void GenIdleSeq(uint16_t dl);
 
   void Upload();
   void Attach();
   void Detach();
-  void Start();
+  // In loop mode the peripheral repeats the frame until StopLoop(),
+  // there is no interrupt at the end of each pass.
+  void Start(bool loop = false);
+  void StopLoop();
+  // The whole frame fits in the peripheral memory and can be looped.
+  bool CanLoop() const;
+
+  // Length of the frame, in ticks.
+  uint32_t frame_len() const;
 
   void Dump();
+  // Feed current sequences to the model.
+  void SetupModel(DisplayModel *model) const;
+  // Copy sequences of |other|, for inspection.
+  void CopySeqs(const DisplayController &other);
 
  private:
   static void ChannelIntHandler(RMTChannel *ch, void *arg);
+  // Changes length of item |i| by |delta|, unless |apply| is false.
+  // Returns false if the item would get out of range.
+  static bool AdjustItem(RMTOutputChannel *ch, size_t i, int32_t delta,
+                         bool apply);
+  bool PatchVisits(const BrightnessLevels &lv, bool apply);
+
+  void SpliceSlotSeq(RMTOutputChannel *ch, uint16_t *pos, int i,
+                     const RMTChannel::Item *seq, size_t seq_len);
 
   RMTOutputChannel srclk_, ser_, qser_, rclk_;
   RMTOutputChannel r_, g_, b_;
+  RMTOutputChannelSet set_;
   void (*int_handler_)();
+
+  // What the sequences currently contain.
+  bool valid_ = false;
+  uint8_t digits_[kNumDigits] = {};
+  uint16_t rl_ = 0, gl_ = 0, bl_ = 0, rlc_ = 0, glc_ = 0, blc_ = 0, dl_ = 0;
+  uint8_t num_planes_ = 1;
+  // Start of each digit visit in the SER and QSER sequences,
+  // visit N is digit N % kNumDigits in plane N / kNumDigits.
+  uint16_t ser_pos_[kMaxPlanes * kNumDigits + 1] = {};
+  uint16_t qser_pos_[kMaxPlanes * kNumDigits + 1] = {};
+  VisitItems visit_items_[kMaxPlanes * kNumDigits] = {};
+  // Levels the sequences currently have, differ from the above after
+  // PatchLevels.
+  BrightnessLevels cur_ = {};
 };
 
+// The frame is built and published right away, but if |show_at_us| is set,
+// it is not shown until esp_timer_get_time() reaches it. This allows to
+// prepare a frame ahead of time and have it shown precisely.
 void SetDisplayDigits(const uint8_t digits[5], uint16_t rl, uint16_t gl,
                       uint16_t bl, uint16_t rlc, uint16_t glc, uint16_t blc,
-                      uint16_t dl);
+                      uint16_t dl, uint8_t num_planes, int64_t show_at_us = 0);
+
+// Set the transition played when digits change. Each step is shown for
+// |step_len| refresh cycles.
+void SetDisplayAnimation(DisplayAnimationType type, int step_len);
+
+// Change levels of the displayed frame gradually, over |num_frames| refresh
+// cycles, by patching it from the interrupt handler. 0 - switch right away.
+void SetDisplayBrightnessRamp(int num_frames);
+
+// Allow looping unchanged frames in hardware.
+void SetDisplayLoop(bool enable);
+
+// Refresh statistics, maintained by the interrupt handler.
+struct DisplayStats {
+  // Frames started by the interrupt handler, looped frames are counted once.
+  uint32_t num_frames;
+  // Frames started in loop mode.
+  uint32_t num_loops;
+  // Switches to a new frame.
+  uint32_t num_swaps;
+  // New frames that were superseded by a newer one before they were shown.
+  uint32_t num_missed_swaps;
+  // Time from TX end interrupt to restart of the channels, CPU cycles.
+  uint32_t restart_cycles_last, restart_cycles_max;
+  uint64_t restart_cycles_sum;
+  // Part of the above spent uploading the frame to the peripheral.
+  uint32_t upload_cycles_last, upload_cycles_max;
+  uint64_t upload_cycles_sum;
+  // Time from the RMT interrupt entry to the display handler, CPU cycles.
+  uint32_t dispatch_cycles_last, dispatch_cycles_max;
+  uint64_t dispatch_cycles_sum;
+  // Time from the end of the frame to the RMT interrupt entry, CPU cycles.
+  // This is the dead time between frames, not counting the restart.
+  // Measured along with the period, so there are num_periods of these.
+  uint32_t latency_cycles_last, latency_cycles_max;
+  uint64_t latency_cycles_sum;
+  // Time between frame starts, CPU cycles.
+  uint64_t period_cycles_sum;
+  uint32_t num_periods;
+  // Deviation of the frame period from the nominal frame length,
+  // bucket N counts deviations under 2^N us, the last one - everything else.
+  static constexpr int kNumJitterBuckets = 8;
+  uint32_t jitter_hist[kNumJitterBuckets];
+  uint32_t cpu_mhz;
+};
+
+// Get a snapshot of the statistics, optionally reset them.
+void GetDisplayStats(DisplayStats *stats, bool reset);
+
+// Run the most recent frame through the display model.
+bool CheckDisplay(DisplayModel::Result *res);
+
+// Time |num_iter| full rebuilds and incremental updates with one digit
+// changing, same as it happens when the time changes.
+void BenchSetDigits(int num_iter, int64_t *full_us, int64_t *incr_us);
 
 }  // namespace clk
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_display_model.hpp"
+
+#include <cstring>
+
+namespace clk {
+
+void DisplayModel::SetLine(Line line, const RMTItem *items, size_t len,
+                           bool idle_value) {
+  LineData &ld = lines_[line];
+  ld.items = items;
+  ld.len = len;
+  ld.idle_value = idle_value;
+}
+
+void DisplayModel::Run(Result *res) const {
+  memset(res, 0, sizeof(*res));
+  size_t idx[kNumLines] = {};
+  uint32_t rem[kNumLines] = {};
+  bool lv[kNumLines] = {};
+  uint32_t tot_len[kNumLines] = {};
+  for (int i = 0; i < kNumLines; i++) {
+    const LineData &ld = lines_[i];
+    for (size_t j = 0; j < ld.len; j++) tot_len[i] += ld.items[j].num_cycles;
+    if (tot_len[i] > res->frame_len) res->frame_len = tot_len[i];
+    if (ld.len > 0) {
+      lv[i] = ld.items[0].val;
+      rem[i] = ld.items[0].num_cycles;
+    } else {
+      lv[i] = ld.idle_value;
+    }
+  }
+  res->in_sync = true;
+  for (int i = 0; i < kNumLines; i++) {
+    if (tot_len[i] != res->frame_len) res->in_sync = false;
+  }
+  // Shift registers and their latches, newest bit is bit 0.
+  // Everything is off (high) initially.
+  uint8_t sr = 0xff, qsr = 0xff, sl = 0xff, ql = 0xff;
+  bool was_lit = false;
+  uint8_t lit_mask[kNumSlots] = {};
+  for (uint32_t t = 0; t < res->frame_len;) {
+    // Time until the next change on any line.
+    uint32_t dt = res->frame_len - t;
+    for (int i = 0; i < kNumLines; i++) {
+      if (rem[i] > 0 && rem[i] < dt) dt = rem[i];
+    }
+    // Output is enabled when OE is low.
+    bool oe[3] = {!lv[kOER], !lv[kOEG], !lv[kOEB]};
+    bool lit = (oe[0] || oe[1] || oe[2]);
+    if (lit) {
+      int num_sel = 0;
+      for (int p = 0; p < 8; p++) {
+        if (ql & (1 << p)) continue;
+        int slot = 7 - p;
+        Digit &d = res->digits[slot];
+        for (int c = 0; c < 3; c++) {
+          if (oe[c]) d.lit[c] += dt;
+        }
+        if (!was_lit) d.num_pulses++;
+        lit_mask[slot] |= (uint8_t) ~sl;
+        num_sel++;
+      }
+      if (num_sel > 1) res->ghost_ticks += dt;
+      if (num_sel == 0) res->blank_ticks += dt;
+    }
+    was_lit = lit;
+    t += dt;
+    // Advance the lines, look for edges.
+    bool prev_lv[kNumLines];
+    memcpy(prev_lv, lv, sizeof(lv));
+    for (int i = 0; i < kNumLines; i++) {
+      if (rem[i] == 0) continue;
+      rem[i] -= dt;
+      if (rem[i] > 0) continue;
+      const LineData &ld = lines_[i];
+      idx[i]++;
+      if (idx[i] < ld.len) {
+        lv[i] = ld.items[idx[i]].val;
+        rem[i] = ld.items[idx[i]].num_cycles;
+      } else {
+        lv[i] = ld.idle_value;
+      }
+    }
+    if (lv[kRCLK] && !prev_lv[kRCLK]) {
+      sl = sr;
+      ql = qsr;
+      if (lit) res->latch_while_lit++;
+    }
+    if (lv[kSRCLK] && !prev_lv[kSRCLK]) {
+      // Data is sampled before the edge.
+      sr = (uint8_t) ((sr << 1) | prev_lv[kSER]);
+      qsr = (uint8_t) ((qsr << 1) | prev_lv[kQSER]);
+    }
+  }
+  for (int slot = 0; slot < kNumSlots; slot++) {
+    // Register pin P holds slot 7 - P, convert to digit value bit order.
+    uint8_t val = 0xff;
+    for (int p = 0; p < 8; p++) {
+      if (lit_mask[slot] & (1 << p)) val &= ~(1 << (7 - p));
+    }
+    res->digits[slot].val = val;
+  }
+}
+
+}  // namespace clk
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clk_rmt_item.hpp"
+
+namespace clk {
+
+// Model of the display hardware: segment (SER) and digit (QSER) shift
+// registers clocked by SRCLK and latched by RCLK, and the active-low
+// OE_R/OE_G/OE_B lines. Plays back the channel sequences of one frame and
+// works out what was actually lit.
+// Does not depend on the peripheral and can be built for the host.
+class DisplayModel {
+ public:
+  enum Line {
+    kSRCLK = 0,
+    kSER = 1,
+    kQSER = 2,
+    kRCLK = 3,
+    kOER = 4,
+    kOEG = 5,
+    kOEB = 6,
+    kNumLines = 7,
+  };
+
+  // Register outputs, slot N is the bit shifted in N-th out of 7, this
+  // corresponds to bit N of the digit value and Q = N - 2.
+  static constexpr int kNumSlots = 8;
+
+  struct Digit {
+    // Segments that were lit, in digit value format (0 - lit).
+    uint8_t val;
+    // Number of OE pulses while this digit was selected.
+    uint16_t num_pulses;
+    // Number of ticks lit, per colour.
+    uint32_t lit[3];
+  };
+
+  struct Result {
+    // Frame length, ticks.
+    uint32_t frame_len;
+    // All lines have the same length.
+    bool in_sync;
+    // Ticks during which output was enabled with more than one digit selected.
+    uint32_t ghost_ticks;
+    // Ticks during which output was enabled with no digit selected.
+    uint32_t blank_ticks;
+    // Number of times registers were latched while output was enabled.
+    uint32_t latch_while_lit;
+    // Per Q slot.
+    Digit digits[kNumSlots];
+  };
+
+  // |idle_value| is the level of the line after the sequence ends.
+  void SetLine(Line line, const RMTItem *items, size_t len, bool idle_value);
+
+  void Run(Result *res) const;
+
+ private:
+  struct LineData {
+    const RMTItem *items = nullptr;
+    size_t len = 0;
+    bool idle_value = false;
+  };
+  LineData lines_[kNumLines];
+};
+
+}  // namespace clk
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_ir_decoder.hpp"
+
+#include <string.h>
+#include <strings.h>
+
+#include "mgos.h"
+
+#include "esp32/clk.h"
+#include "xtensa/hal.h"
+
+namespace clk {
+
+// Level of the first item after idle, the receiver is active low.
+static constexpr uint16_t kMarkVal = 1;
+
+enum class IREncoding : uint8_t {
+  kPulseDistance,  // Bit value is in the length of the space (NEC).
+  kPulseWidth,     // Bit value is in the length of the mark (SIRC).
+  kBiphase,        // Bit value is the level of the first half (RC5, RC6).
+  kSelfCalib,      // Lengths of 0 and 1 are sent before the data (native).
+};
+
+// Protocol timing table. Lengths are in microseconds, 0 - not used.
+struct IRProtocolDesc {
+  IRProtocol proto;
+  const char *name;
+  IREncoding enc;
+  uint8_t tol_pct;
+  uint8_t num_bits;
+  bool msb_first;
+  uint16_t hdr_mark, hdr_space;
+  // Repeat code, sent while the button is held down. If |rpt_end| is set,
+  // it is a reception on its own (its timing is too generic otherwise).
+  uint16_t rpt_mark, rpt_space;
+  bool rpt_end;
+  // Pulse distance and pulse width: lengths of the bit marks and spaces.
+  uint16_t zero_mark, zero_space, one_mark, one_space;
+  // Biphase: length of a half-bit, "1" starts with a mark, index of the bit
+  // that is twice as long and of the toggle bit (masked out of the code).
+  uint16_t unit;
+  bool one_mark_first;
+  int8_t wide_bit, toggle_bit;
+};
+
+static constexpr IRProtocolDesc kIRProtocols[] = {
+    {IRProtocol::kNative, "native", IREncoding::kSelfCalib, 15, 16, true,
+     4500, 0, 2200, 550, true, 0, 0, 0, 0, 0, false, -1, -1},
+    {IRProtocol::kNEC, "nec", IREncoding::kPulseDistance, 25, 32, false, 9000,
+     4500, 9000, 2250, false, 560, 560, 560, 1690, 0, false, -1, -1},
+    // Start bits, toggle, 5 bits of address, 6 bits of command.
+    {IRProtocol::kRC5, "rc5", IREncoding::kBiphase, 25, 14, true, 0, 0, 0, 0,
+     false, 0, 0, 0, 0, 889, false, -1, 2},
+    // Mode 0: start bit, 3 bits of mode, trailer (toggle), 8 bits of address,
+    // 8 bits of command.
+    {IRProtocol::kRC6, "rc6", IREncoding::kBiphase, 25, 21, true, 2666, 889, 0,
+     0, false, 0, 0, 0, 0, 444, true, 4, 4},
+    // 12-bit variant: 7 bits of command, 5 bits of address.
+    {IRProtocol::kSIRC, "sirc", IREncoding::kPulseWidth, 25, 12, false, 2400,
+     600, 0, 0, false, 600, 600, 1200, 600, 0, false, -1, -1},
+};
+
+static_assert(sizeof(kIRProtocols) / sizeof(kIRProtocols[0]) ==
+                  (size_t) IRProtocol::kMax,
+              "Protocol table mismatch");
+
+static constexpr uint32_t MaxLen(uint32_t a, uint32_t b) {
+  return (a > b ? a : b);
+}
+
+// Longest item of a protocol that still matches, biphase items cover up to
+// 4 units.
+static constexpr uint32_t ProtocolMaxItemLen(const IRProtocolDesc &pd) {
+  return MaxLen(
+             MaxLen(MaxLen(pd.hdr_mark, pd.hdr_space),
+                    MaxLen(pd.rpt_mark, pd.rpt_space)),
+             MaxLen(MaxLen(MaxLen(pd.zero_mark, pd.zero_space),
+                           MaxLen(pd.one_mark, pd.one_space)),
+                    4U * pd.unit)) *
+         (100 + pd.tol_pct) / 100;
+}
+
+static constexpr uint32_t TableMaxItemLen(size_t i = 0) {
+  return (i >= sizeof(kIRProtocols) / sizeof(kIRProtocols[0])
+              ? 0
+              : MaxLen(ProtocolMaxItemLen(kIRProtocols[i]),
+                       TableMaxItemLen(i + 1)));
+}
+
+static_assert(TableMaxItemLen() <= kIRMaxItemLen,
+              "kIRMaxItemLen does not cover the protocol table");
+
+const char *IRProtocolName(IRProtocol proto) {
+  if (proto >= IRProtocol::kMax) return "";
+  return kIRProtocols[(int) proto].name;
+}
+
+bool IRProtocolFromName(const char *name, size_t len, IRProtocol *proto) {
+  for (const auto &pd : kIRProtocols) {
+    if (strlen(pd.name) == len && strncasecmp(pd.name, name, len) == 0) {
+      *proto = pd.proto;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t Diff(uint32_t val, uint32_t exp) {
+  return (val > exp ? val - exp : exp - val);
+}
+
+static bool Match(uint32_t val, uint32_t exp, uint32_t tol_pct) {
+  if (exp == 0) return false;
+  return Diff(val, exp) * 100 <= exp * tol_pct;
+}
+
+static void AddBit(const IRProtocolDesc &pd, uint32_t *code, uint8_t *nbits,
+                   bool one) {
+  if (pd.msb_first) {
+    *code = (*code << 1) | one;
+  } else {
+    *code |= ((uint32_t) one << *nbits);
+  }
+  (*nbits)++;
+}
+
+void IRDecoder::StartData(const IRProtocolDesc &pd, State *s) {
+  *s = {};
+  s->phase = (pd.enc == IREncoding::kSelfCalib ? Phase::kCalib0 : Phase::kBits);
+}
+
+// Unit loop: an item covers one or more half-bits of the same level.
+IRDecoder::Result IRDecoder::StepBiphase(const IRProtocolDesc &pd, State *s,
+                                         bool mark, uint32_t len) {
+  uint32_t n = (len + pd.unit / 2) / pd.unit;
+  if (n < 1 || n > 4 || !Match(len, n * pd.unit, pd.tol_pct)) {
+    return Result::kFail;
+  }
+  for (; n > 0; n--, s->pos++) {
+    int w = (s->nbits == pd.wide_bit ? 4 : 2);
+    int off = s->pos - s->bit_start;
+    if (off == 0) {
+      s->first_mark = mark;
+    } else if ((off < w / 2) != (mark == s->first_mark)) {
+      // Level must be the same within a half and change in the middle.
+      return Result::kFail;
+    }
+    // Second half of the last bit may be lost in the idle line,
+    // the first one is enough.
+    if (off == w / 2 - 1 && s->nbits == pd.num_bits - 1) {
+      AddBit(pd, &s->code, &s->nbits, (s->first_mark == pd.one_mark_first));
+      return Result::kDone;
+    }
+    if (off == w - 1) {
+      AddBit(pd, &s->code, &s->nbits, (s->first_mark == pd.one_mark_first));
+      s->bit_start += w;
+    }
+  }
+  return Result::kMore;
+}
+
+// Pulse distance and pulse width: mark and space per bit, value is decided by
+// the one whose lengths differ for 0 and 1.
+IRDecoder::Result IRDecoder::StepPulse(const IRProtocolDesc &pd, State *s,
+                                       bool mark, uint32_t len) {
+  if (mark != (s->pos % 2 == 0)) return Result::kFail;
+  uint16_t l0 = (mark ? pd.zero_mark : pd.zero_space);
+  uint16_t l1 = (mark ? pd.one_mark : pd.one_space);
+  bool m0 = Match(len, l0, pd.tol_pct), m1 = Match(len, l1, pd.tol_pct);
+  if (!m0 && !m1) return Result::kFail;
+  s->pos++;
+  if (l0 == l1) return Result::kMore;
+  bool one = (m1 && !(m0 && Diff(len, l0) <= Diff(len, l1)));
+  AddBit(pd, &s->code, &s->nbits, one);
+  return (s->nbits == pd.num_bits ? Result::kDone : Result::kMore);
+}
+
+// Calibration sequence: 8 low-high pairs of the same lengths.
+IRDecoder::Result IRDecoder::StepCalib(const IRProtocolDesc &pd, State *s,
+                                       bool mark, uint32_t len) {
+  int k = s->pos % 2;
+  if (s->pos == 0 && mark) return Result::kFail;
+  if (s->pos >= 2 && !Match(len, s->prev[k], pd.tol_pct)) return Result::kFail;
+  if (s->pos < 2) s->sum[k] = 0;
+  s->sum[k] += len;
+  s->prev[k] = len;
+  s->pos++;
+  if (s->pos < 16) return Result::kMore;
+  uint32_t lo = s->sum[0] / 8, hi = s->sum[1] / 8;
+  s->pos = 0;
+  if (s->phase == Phase::kCalib0) {
+    s->lo0 = lo;
+    s->hi0 = hi;
+    s->phase = Phase::kCalib1;
+    return Result::kMore;
+  }
+  LOG(LL_VERBOSE_DEBUG, ("0: %d %d | 1: %d %d", (int) s->lo0, (int) s->hi0,
+                         (int) lo, (int) hi));
+  // Low should be abot the same in both cases.
+  if (!Match(s->lo0, lo, pd.tol_pct)) return Result::kFail;
+  // "1" must be different from "0".
+  if (Match(s->hi0, hi, pd.tol_pct)) return Result::kFail;
+  // From now on, prev is the "0" and "1" high lengths.
+  s->prev[0] = s->hi0;
+  s->prev[1] = hi;
+  s->phase = Phase::kBits;
+  return Result::kMore;
+}
+
+// Self-calibrating data: a low, then 16 highs separated by lows.
+// Exactly 8 bits must be set.
+IRDecoder::Result IRDecoder::StepSelfCalib(const IRProtocolDesc &pd, State *s,
+                                           bool mark, uint32_t len) {
+  // Lows are not checked.
+  if (s->pos++ % 2 == 0) return Result::kMore;
+  (void) mark;
+  if (Match(len, s->prev[1], pd.tol_pct)) {
+    AddBit(pd, &s->code, &s->nbits, true);
+  } else if (Match(len, s->prev[0], pd.tol_pct)) {
+    AddBit(pd, &s->code, &s->nbits, false);
+  } else {
+    return Result::kFail;
+  }
+  if (s->nbits < pd.num_bits) return Result::kMore;
+  return (__builtin_popcount(s->code) == 8 ? Result::kDone : Result::kFail);
+}
+
+IRDecoder::Result IRDecoder::Step(const IRProtocolDesc &pd, State *s,
+                                  const RMTItem &it) {
+  const bool mark = (it.val == kMarkVal);
+  const uint32_t len = it.num_cycles;
+  switch (s->phase) {
+    case Phase::kIdle:
+      if (!mark) break;
+      if (pd.hdr_mark == 0) {
+        // No header, first half of the first bit is a space (idle line).
+        StartData(pd, s);
+        s->first_mark = false;
+        s->pos = 1;
+        return StepBiphase(pd, s, mark, len);
+      }
+      s->hdr_ok = Match(len, pd.hdr_mark, pd.tol_pct);
+      s->rpt_ok = Match(len, pd.rpt_mark, pd.tol_pct);
+      if (s->hdr_ok && pd.hdr_space == 0 && !s->rpt_ok) {
+        StartData(pd, s);
+        return Result::kMore;
+      }
+      if (!s->hdr_ok && !s->rpt_ok) break;
+      s->phase = Phase::kHeader;
+      return Result::kMore;
+    case Phase::kHeader:
+      if (mark) break;
+      if (s->hdr_ok && Match(len, pd.hdr_space, pd.tol_pct)) {
+        StartData(pd, s);
+        return Result::kMore;
+      }
+      if (s->rpt_ok && Match(len, pd.rpt_space, pd.tol_pct)) {
+        s->hold = true;
+        if (!pd.rpt_end) return Result::kDone;
+        s->phase = Phase::kRepeatEnd;
+        return Result::kMore;
+      }
+      break;
+    case Phase::kRepeatEnd:
+      break;
+    case Phase::kCalib0:
+    case Phase::kCalib1:
+      return StepCalib(pd, s, mark, len);
+    case Phase::kBits:
+      switch (pd.enc) {
+        case IREncoding::kPulseDistance:
+        case IREncoding::kPulseWidth:
+          return StepPulse(pd, s, mark, len);
+        case IREncoding::kBiphase:
+          return StepBiphase(pd, s, mark, len);
+        case IREncoding::kSelfCalib:
+          return StepSelfCalib(pd, s, mark, len);
+      }
+      break;
+  }
+  return Result::kFail;
+}
+
+void IRDecoder::Finish(const IRProtocolDesc &pd, const State &s,
+                       IRCode *code) {
+  code->proto = pd.proto;
+  code->hold = s.hold;
+  code->code = s.code;
+  if (pd.toggle_bit >= 0) {
+    int tb = (pd.msb_first ? pd.num_bits - 1 - pd.toggle_bit : pd.toggle_bit);
+    code->code &= ~(1U << tb);
+  }
+}
+
+bool IRDecoder::Feed(const RMTItem &it, IRCode *code) {
+  bool res = false;
+  for (const auto &pd : kIRProtocols) {
+    State *s = &st_[(int) pd.proto];
+    Phase phase = s->phase;
+    Result r = Step(pd, s, it);
+    if (r == Result::kFail) {
+      *s = {};
+      // Not a continuation, may be the start of a new code.
+      if (phase != Phase::kIdle) r = Step(pd, s, it);
+      if (r == Result::kFail) *s = {};
+    }
+    if (r != Result::kDone) continue;
+    if (!res) Finish(pd, *s, code);
+    res = true;
+    *s = {};
+  }
+  return res;
+}
+
+bool IRDecoder::End(IRCode *code) {
+  bool res = false;
+  for (const auto &pd : kIRProtocols) {
+    State *s = &st_[(int) pd.proto];
+    if (s->phase == Phase::kRepeatEnd && !res) {
+      Finish(pd, *s, code);
+      res = true;
+    }
+    *s = {};
+  }
+  return res;
+}
+
+// Decodes a whole sequence, returns the first code.
+static bool DecodeAll(IRDecoder *dec, const RMTItem *items, size_t len,
+                      IRCode *code) {
+  bool res = false;
+  IRCode c;
+  for (size_t i = 0; i < len; i++) {
+    if (dec->Feed(items[i], &c) && !res) {
+      *code = c;
+      res = true;
+    }
+  }
+  if (dec->End(&c) && !res) {
+    *code = c;
+    res = true;
+  }
+  return res;
+}
+
+static uint32_t Rand(uint32_t *state) {
+  // xorshift32
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static uint16_t Jitter(uint32_t len, int pct, uint32_t *rs) {
+  int32_t v = len;
+  if (pct > 0) {
+    int32_t d = v * pct / 100;
+    v += (int32_t) (Rand(rs) % (2 * d + 1)) - d;
+  }
+  if (v < 1) v = 1;
+  if (v > 0x7fff) v = 0x7fff;
+  return v;
+}
+
+void BenchIRDecoder(const RMTItem *items, size_t len,
+                    const IRBenchParams &params, IRBenchResult *res) {
+  // Glitch length, microseconds.
+  static constexpr uint16_t kGlitchLen = 100;
+  static constexpr size_t kMaxLen = 128;
+  // Each item may become three.
+  static RMTItem s_buf[kMaxLen * 3];
+  static IRDecoder s_dec;
+  *res = {};
+  if (len > kMaxLen) len = kMaxLen;
+  s_dec = {};
+  res->ref_ok = DecodeAll(&s_dec, items, len, &res->ref);
+  uint32_t rs = (params.seed != 0 ? params.seed : 1);
+  uint64_t sum_cycles = 0;
+  for (int n = 0; n < params.num_iter; n++) {
+    size_t blen = 0, end = len;
+    if (params.trunc_pct > 0 && (int) (Rand(&rs) % 100) < params.trunc_pct) {
+      end = Rand(&rs) % len;
+    }
+    for (size_t i = 0; i < end; i++) {
+      RMTItem it = items[i];
+      it.num_cycles = Jitter(it.num_cycles, params.jitter_pct, &rs);
+      if (params.noise_pct > 0 && it.num_cycles > 3 * kGlitchLen &&
+          (int) (Rand(&rs) % 100) < params.noise_pct) {
+        // Glitch ends at |l1|, both parts of the item stay longer than it:
+        // a 0-length item would end the sequence.
+        uint16_t l1 =
+            2 * kGlitchLen + Rand(&rs) % (it.num_cycles - 3 * kGlitchLen);
+        RMTItem g = {kGlitchLen, (uint16_t) !it.val};
+        RMTItem it2 = it;
+        it.num_cycles = l1 - kGlitchLen;
+        it2.num_cycles -= l1;
+        s_buf[blen++] = it;
+        s_buf[blen++] = g;
+        it = it2;
+      }
+      s_buf[blen++] = it;
+    }
+    IRCode c;
+    s_dec = {};
+    uint32_t start = xthal_get_ccount();
+    bool ok = DecodeAll(&s_dec, s_buf, blen, &c);
+    uint32_t cycles = xthal_get_ccount() - start;
+    sum_cycles += cycles;
+    if (cycles > res->max_cycles) res->max_cycles = cycles;
+    if (!ok) {
+      res->num_none++;
+    } else if (res->ref_ok && c.proto == res->ref.proto &&
+               c.hold == res->ref.hold && c.code == res->ref.code) {
+      res->num_ok++;
+    } else {
+      res->num_wrong++;
+    }
+  }
+  if (params.num_iter > 0) res->avg_cycles = sum_cycles / params.num_iter;
+  res->cpu_mhz = esp_clk_cpu_freq() / 1000000;
+}
+
+}  // namespace clk
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clk_rmt_item.hpp"
+
+namespace clk {
+
+enum class IRProtocol : uint8_t {
+  kNative = 0,  // Self-calibrating protocol of the clock's own remote.
+  kNEC = 1,
+  kRC5 = 2,
+  kRC6 = 3,
+  kSIRC = 4,
+  kMax,
+};
+
+// Longest mark or space of any supported protocol, with tolerance, us.
+// Receiver idle threshold must be above it, or reception ends in the middle
+// of a code.
+static constexpr uint32_t kIRMaxItemLen = 11250;
+
+const char *IRProtocolName(IRProtocol proto);
+
+// Returns false if the name is not known.
+bool IRProtocolFromName(const char *name, size_t len, IRProtocol *proto);
+
+struct IRCode {
+  IRProtocol proto;
+  // Hold (repeat) code, |code| is not valid.
+  bool hold;
+  uint32_t code;
+};
+
+struct IRProtocolDesc;
+
+// Streaming decoder for all the supported protocols.
+// Items are fed one at a time and all protocols advance in parallel,
+// each according to its timing table.
+class IRDecoder {
+ public:
+  // Feed the next received item. Returns true and fills |*code| as soon as
+  // the item completing a code has been received.
+  bool Feed(const RMTItem &it, IRCode *code);
+
+  // End of reception, nothing can continue across it.
+  // Returns true and fills |*code| if it completes a code.
+  bool End(IRCode *code);
+
+ private:
+  enum class Phase : uint8_t {
+    kIdle = 0,
+    kHeader,  // Header or repeat mark received.
+    kCalib0,  // Self-calibrating: "0" calibration sequence.
+    kCalib1,  // Self-calibrating: "1" calibration sequence.
+    kBits,
+    kRepeatEnd,  // Repeat code received, must be followed by end of reception.
+  };
+
+  enum class Result {
+    kMore,
+    kDone,
+    kFail,
+  };
+
+  struct State {
+    Phase phase;
+    bool hdr_ok, rpt_ok, hold;
+    uint8_t nbits;
+    // Item position (unit position for biphase).
+    uint8_t pos;
+    // Biphase: unit at which the current bit starts and the level of its
+    // first half.
+    uint8_t bit_start;
+    bool first_mark;
+    uint32_t code;
+    // Self-calibrating: last and total lengths of lows and highs,
+    // then the "0" and "1" high lengths.
+    uint32_t prev[2], sum[2];
+    uint32_t lo0, hi0;
+  };
+
+  static void Finish(const IRProtocolDesc &pd, const State &s, IRCode *code);
+  static void StartData(const IRProtocolDesc &pd, State *s);
+  static Result Step(const IRProtocolDesc &pd, State *s, const RMTItem &it);
+  static Result StepBiphase(const IRProtocolDesc &pd, State *s, bool mark,
+                            uint32_t len);
+  static Result StepPulse(const IRProtocolDesc &pd, State *s, bool mark,
+                          uint32_t len);
+  static Result StepCalib(const IRProtocolDesc &pd, State *s, bool mark,
+                          uint32_t len);
+  static Result StepSelfCalib(const IRProtocolDesc &pd, State *s, bool mark,
+                              uint32_t len);
+
+  State st_[(int) IRProtocol::kMax] = {};
+};
+
+// Perturbations applied to a sequence by BenchIRDecoder.
+struct IRBenchParams {
+  int num_iter;
+  // Each length is changed by a random amount of up to this many percent.
+  int jitter_pct;
+  // Probability (percent) of a short glitch in the middle of an item.
+  int noise_pct;
+  // Probability (percent) of the sequence being cut short at a random item.
+  int trunc_pct;
+  uint32_t seed;
+};
+
+struct IRBenchResult {
+  // Result of decoding the unmodified sequence.
+  bool ref_ok;
+  IRCode ref;
+  // Perturbed sequences decoded to the same code, to a different one or to
+  // nothing.
+  int num_ok, num_wrong, num_none;
+  // Decoding cost per sequence.
+  uint32_t avg_cycles, max_cycles;
+  uint32_t cpu_mhz;
+};
+
+// Replays |items| through a fresh decoder |params.num_iter| times, with
+// random perturbations, and compares the results with the unmodified one.
+void BenchIRDecoder(const RMTItem *items, size_t len,
+                    const IRBenchParams &params, IRBenchResult *res);
+
+}  // namespace clk
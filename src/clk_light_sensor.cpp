@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_light_sensor.hpp"
+
+#include "mgos.hpp"
+#include "mgos_bh1750.h"
+#include "mgos_timers.hpp"
+#include "mgos_veml7700.h"
+
+namespace clk {
+
+// The sensor shares the I2C bus with other users on the main task (e.g.
+// the I2C RPC service) and the bus API is not thread-safe, so sampling runs
+// on the main task too, from a timer. Display updates only read the result.
+
+// Median over this many samples removes outliers.
+static constexpr int kMedianLen = 5;
+// Then exponential moving average, new = old + (median - old) / kEMADiv.
+static constexpr int32_t kEMADiv = 4;
+
+static struct mgos_bh1750 *s_bh = nullptr;
+static struct mgos_veml7700 *s_veml = nullptr;
+static struct mgos_i2c *s_bus = nullptr;
+static int s_reset_gpio = -1;
+static bool s_detected = false;
+
+// Latest filtered value.
+static int32_t s_lux = -1;
+
+// Sampler state.
+static int32_t s_samples[kMedianLen];
+static int s_num_samples = 0, s_sample_idx = 0;
+// EMA, 24.8 fixed point.
+static int32_t s_ema = -1;
+
+static int32_t Median(const int32_t *v, int n) {
+  int32_t s[kMedianLen];
+  for (int i = 0; i < n; i++) {
+    int j = i;
+    for (; j > 0 && s[j - 1] > v[i]; j--) s[j] = s[j - 1];
+    s[j] = v[i];
+  }
+  return s[n / 2];
+}
+
+static void AddSample(int32_t lux) {
+  s_samples[s_sample_idx] = lux;
+  s_sample_idx = (s_sample_idx + 1) % kMedianLen;
+  if (s_num_samples < kMedianLen) s_num_samples++;
+  int32_t med = Median(s_samples, s_num_samples) << 8;
+  if (s_ema < 0) {
+    s_ema = med;
+  } else {
+    s_ema += (med - s_ema) / kEMADiv;
+  }
+  s_lux = (s_ema + 0x80) >> 8;
+}
+
+static int32_t ReadSensor() {
+  float lux = -1;
+  if (s_bh != nullptr) {
+    lux = mgos_bh1750_read_lux(s_bh, nullptr);
+  } else if (s_veml != nullptr) {
+    lux = mgos_veml7700_read_lux(s_veml, true /* adjust */);
+  }
+  return (lux >= 0 ? (int32_t) (lux + 0.5f) : -1);
+}
+
+static bool DetectSensor(struct mgos_i2c *bus) {
+  uint8_t bh1750_addr = mgos_bh1750_detect_i2c(bus);
+  if (bh1750_addr != 0) {
+    LOG(LL_INFO, ("Found BH1750 sensor at %#x", bh1750_addr));
+    s_bh = mgos_bh1750_create(bh1750_addr);
+    mgos_bh1750_set_config(s_bh, MGOS_BH1750_MODE_CONT_HIGH_RES_2,
+                           mgos_sys_config_get_clock_bh1750_mtime());
+  } else if (mgos_veml7700_detect(bus)) {
+    LOG(LL_INFO, ("Found VEML7700 sensor"));
+    s_veml = mgos_veml7700_create(bus);
+    mgos_veml7700_set_cfg(
+        s_veml, MGOS_VEML7700_CFG_ALS_IT_100 | MGOS_VEML7700_CFG_ALS_GAIN_1,
+        MGOS_VEML7700_PSM_0);
+  } else {
+    LOG(LL_ERROR, ("No light sensor found!"));
+    return false;
+  }
+  return true;
+}
+
+static void SensorTimerCB();
+static mgos::Timer s_tmr(SensorTimerCB);
+
+static void SensorTimerCB() {
+  if (!s_detected) {
+    if (s_reset_gpio >= 0) mgos_gpio_write(s_reset_gpio, 1);
+    if (!DetectSensor(s_bus)) return;
+    s_detected = true;
+  }
+  int32_t lux = ReadSensor();
+  // Failed reads are skipped, the last value stays.
+  if (lux >= 0) AddSample(lux);
+  int interval_ms = mgos_sys_config_get_clock_sensor_interval_ms();
+  s_tmr.Reset((interval_ms > 0 ? interval_ms : 1000), 0);
+}
+
+bool LightSensorInit(struct mgos_i2c *bus, int reset_gpio) {
+  s_bus = bus;
+  s_reset_gpio = reset_gpio;
+  // Sensor is held in reset until the first timer run.
+  if (reset_gpio >= 0) mgos_gpio_setup_output(reset_gpio, 0);
+  return s_tmr.Reset(2, 0);
+}
+
+int32_t GetLux() {
+  return s_lux;
+}
+
+}  // namespace clk
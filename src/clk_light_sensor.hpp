@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct mgos_i2c;
+
+namespace clk {
+
+// Starts the sampler that resets the sensor (if |reset_gpio| is set),
+// detects it on the bus and samples it periodically. Does not block,
+// returns false if the timer could not be set.
+bool LightSensorInit(struct mgos_i2c *bus, int reset_gpio = -1);
+
+// Latest filtered illuminance, -1 if not known.
+// Does not block or touch the bus. Main task only.
+int32_t GetLux();
+
+}  // namespace clk
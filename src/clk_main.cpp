@@ -3,16 +3,25 @@
  * All rights reserved
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 
 #include "mgos.hpp"
 #include "mgos_app.h"
-#include "mgos_bh1750.h"
+#include "mgos_ota.h"
 #include "mgos_rpc.h"
 #include "mgos_timers.hpp"
-#include "mgos_veml7700.h"
 
+#include "esp_timer.h"
+
+#include "clk_brightness.hpp"
+#include "clk_config.hpp"
 #include "clk_display_controller.hpp"
+#include "clk_ir_decoder.hpp"
+#include "clk_light_sensor.hpp"
 #include "clk_remote_control.hpp"
 #include "clk_rmt_input_channel.hpp"
 
@@ -37,82 +46,190 @@ static const uint8_t s_syms[16] = {
     0x71,  // 0111 0001, "F"
 };
 
+// Segment g only.
+static constexpr uint8_t kDigitValueDash = 0xfd;
+
+// Time before this is not valid: not set since power up.
+static constexpr double kMinValidTime = 1577836800;  // 2020-01-01
+
 static char time_str[9] = {'1', '2', ':', '3', '4', ':', '5', '5'};
-static uint16_t s_rl = 0, s_gl = 0, s_bl = 0, s_dl = 0;
-static uint16_t s_rlc = 0, s_glc = 0, s_blc = 0;
+// Idle time set manually, used when brightness is set to -1.
+static uint16_t s_dl = 0;
 static bool s_show_time = true;
 
-static struct mgos_bh1750 *s_bh = NULL;
-static struct mgos_veml7700 *s_veml = NULL;
-
-static int CalcBrightness(float lux) {
-  float br_pct = mgos_sys_config_get_clock_br();
-  if (mgos_sys_config_get_clock_br_auto() && lux >= 0) {
-    br_pct = (lux * mgos_sys_config_get_clock_br_auto_f());
-  }
-  s_rl = (int) mgos_sys_config_get_clock_rl();
-  s_gl = (int) mgos_sys_config_get_clock_gl();
-  s_bl = (int) mgos_sys_config_get_clock_bl();
-  s_rlc = (int) mgos_sys_config_get_clock_rlc();
-  s_glc = (int) mgos_sys_config_get_clock_glc();
-  s_blc = (int) mgos_sys_config_get_clock_blc();
-  if (br_pct < 0) {
-    return br_pct;
-  }
-  if (br_pct < 1) br_pct = 1;
-  if (br_pct > 100) br_pct = 100;
-  s_rl /= (101 - br_pct);
-  s_gl /= (101 - br_pct);
-  s_bl /= (101 - br_pct);
-  s_rlc /= (101 - br_pct);
-  s_glc /= (101 - br_pct);
-  s_blc /= (101 - br_pct);
-  s_dl = (mgos_sys_config_get_clock_br_auto_dl_max() -
-          (br_pct * mgos_sys_config_get_clock_br_auto_dl_f()));
-  return br_pct;
-}
+// Display parameters derived from the config. Only used on the mgos task,
+// rebuilt when the config changes.
+struct DisplayParams {
+  BrightnessTable br_table;
+  // Colon digit value for even and odd seconds.
+  uint8_t colon[2];
+  uint8_t bcm_bits;
+};
+static DisplayParams s_disp_params;
 
-static void UpdateDisplay() {
-  if (s_show_time) {
-    mgos_strftime(time_str, sizeof(time_str), "%H:%M:%S", (int) mg_time());
-  }
-  uint8_t tens_hours = (time_str[0] == '0' ? DisplayController::kDigitValueEmpty
-                                           : s_syms[time_str[0] - '0']);
-  uint8_t colon = DisplayController::kDigitValueEmpty;
+// Rebuild display parameters from config, must be called when it changes.
+static void UpdateDisplayParams() {
+  DisplayParams *p = &s_disp_params;
+  BrightnessTable::Config cfg;
+  cfg.rl = mgos_sys_config_get_clock_rl();
+  cfg.gl = mgos_sys_config_get_clock_gl();
+  cfg.bl = mgos_sys_config_get_clock_bl();
+  cfg.rlc = mgos_sys_config_get_clock_rlc();
+  cfg.glc = mgos_sys_config_get_clock_glc();
+  cfg.blc = mgos_sys_config_get_clock_blc();
+  cfg.br = mgos_sys_config_get_clock_br();
+  cfg.br_auto = mgos_sys_config_get_clock_br_auto();
+  cfg.br_auto_f = mgos_sys_config_get_clock_br_auto_f();
+  cfg.dl_max = mgos_sys_config_get_clock_br_auto_dl_max();
+  cfg.dl_f = mgos_sys_config_get_clock_br_auto_dl_f();
+  cfg.gamma = mgos_sys_config_get_clock_br_gamma();
+  p->br_table.Build(cfg);
+  const uint8_t c = DisplayController::kDigitValueColon,
+                e = DisplayController::kDigitValueEmpty;
   switch (mgos_sys_config_get_clock_colon_mode()) {
-    case 0:
-      break;
     case 1:
-      colon = DisplayController::kDigitValueColon;
+      p->colon[0] = p->colon[1] = c;
       break;
     case 2:
-      if (time_str[7] % 2 == 0) colon = DisplayController::kDigitValueColon;
+      p->colon[0] = c;
+      p->colon[1] = e;
       break;
     case 3:
-      if (time_str[7] % 2 == 1) colon = DisplayController::kDigitValueColon;
+      p->colon[0] = e;
+      p->colon[1] = c;
       break;
+    default:
+      p->colon[0] = p->colon[1] = e;
+  }
+  p->bcm_bits = mgos_sys_config_get_clock_bcm_bits();
+}
+
+// Digit value for a character of the time string.
+static uint8_t CharDigit(char c) {
+  if (c >= '0' && c <= '9') return s_syms[c - '0'];
+  if (c == '-') return kDigitValueDash;
+  return DisplayController::kDigitValueEmpty;
+}
+
+// Next frame is prepared this long before the second boundary.
+static constexpr int kDisplayLeadMs = 100;
+// Second shown (or scheduled to be shown), -1 - none.
+static double s_shown_sec = -1;
+
+// Show the time |t|. If |show_at_us| is set, the frame is prepared now
+// and shown at that time.
+static void UpdateDisplayAt(double t, int64_t show_at_us) {
+  if (s_show_time) {
+    if (t >= kMinValidTime) {
+      mgos_strftime(time_str, sizeof(time_str), "%H:%M:%S", (int) t);
+    } else {
+      strcpy(time_str, "--:--:--");
+    }
   }
+  s_shown_sec = t;
+  const DisplayParams *p = &s_disp_params;
+  uint8_t tens_hours = (time_str[0] == '0' ? DisplayController::kDigitValueEmpty
+                                           : CharDigit(time_str[0]));
   const uint8_t digits[5] = {
       tens_hours,
-      s_syms[time_str[1] - '0'],
-      colon,
-      s_syms[time_str[3] - '0'],
-      s_syms[time_str[4] - '0'],
+      CharDigit(time_str[1]),
+      p->colon[time_str[7] & 1],
+      CharDigit(time_str[3]),
+      CharDigit(time_str[4]),
   };
-  float lux = -1;
-  int br = mgos_sys_config_get_clock_br();
-  if (s_bh != NULL) {
-    lux = mgos_bh1750_read_lux(s_bh, nullptr);
-  } else if (s_veml != NULL) {
-    lux = mgos_veml7700_read_lux(s_veml, true /* adjust */);
+  int32_t lux = GetLux();
+  int br = p->br_table.GetLevel(lux);
+  BrightnessLevels lv;
+  p->br_table.GetLevels(br, s_dl, &lv);
+  SetDisplayDigits(digits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                   p->bcm_bits, show_at_us);
+  LOG(LL_INFO, ("%s lux %d rl %d gl %d bl %d dl %d br %d", time_str, (int) lux,
+                lv.rl, lv.gl, lv.bl, lv.dl, br));
+}
+
+static void DisplayTimerCB();
+static mgos::Timer s_tmr(DisplayTimerCB);
+
+// Runs kDisplayLeadMs before each second boundary and publishes the frame
+// for the next second, to be shown exactly at the boundary. Timer delays do
+// not accumulate: each run is scheduled from the current time.
+static void DisplayTimerCB() {
+  double now = mg_time();
+  int64_t now_us = esp_timer_get_time();
+  double sec = floor(now);
+  double left = sec + 1 - now;
+  if (sec != s_shown_sec) {
+    // Late or re-phasing, show the current second right away.
+    UpdateDisplayAt(sec, 0);
+  } else {
+    UpdateDisplayAt(sec + 1, now_us + (int64_t) (left * 1000000));
+    left += 1;
   }
-  br = CalcBrightness(lux);
-  SetDisplayDigits(digits, s_rl, s_gl, s_bl, s_rlc, s_glc, s_blc, s_dl);
-  LOG(LL_INFO, ("%s lux %.2f rl %d gl %d bl %d dl %d br %d", time_str, lux,
-                s_rl, s_gl, s_bl, s_dl, br));
+  int delay_ms = (int) (left * 1000) - kDisplayLeadMs;
+  s_tmr.Reset(std::max(delay_ms, 0), 0);
+}
+
+// Show current state right away and re-phase the schedule.
+static void UpdateDisplay() {
+  s_shown_sec = -1;
+  DisplayTimerCB();
 }
 
-static mgos::Timer s_tmr(UpdateDisplay);
+static void TimeChangedCB(int ev, void *ev_data, void *userdata) {
+  UpdateDisplay();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+// Config is saved once it has not changed for clock.save_delay_ms, so that
+// a stream of changes results in a single write. Pending save is flushed
+// before reboot and OTA.
+static void SaveConfig();
+static mgos::Timer s_save_tmr(SaveConfig);
+static bool s_save_pending = false;
+
+static void SaveConfig() {
+  s_save_tmr.Clear();
+  if (!s_save_pending) return;
+  s_save_pending = false;
+  char *msg = nullptr;
+  if (!mgos_sys_config_save(&mgos_sys_config, false, &msg)) {
+    LOG(LL_ERROR, ("Failed to save config: %s", (msg ? msg : "")));
+  }
+  free(msg);
+}
+
+static void ScheduleConfigSave() {
+  s_save_pending = true;
+  s_save_tmr.Reset(std::max(mgos_sys_config_get_clock_save_delay_ms(), 0), 0);
+}
+
+static void FlushConfigCB(int ev, void *ev_data, void *userdata) {
+  SaveConfig();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+// Apply clock.* config, must be called when it changes.
+static void ApplyConfig() {
+  UpdateDisplayParams();
+  SetDisplayAnimation(
+      (DisplayAnimationType) mgos_sys_config_get_clock_anim_mode(),
+      mgos_sys_config_get_clock_anim_step_len());
+  SetDisplayLoop(mgos_sys_config_get_clock_display_loop());
+  SetDisplayBrightnessRamp(mgos_sys_config_get_clock_br_ramp_frames());
+}
+
+static void ConfigChangedCB(int ev, void *ev_data, void *userdata) {
+  ApplyConfig();
+  UpdateDisplay();
+  ScheduleConfigSave();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
 
 static void SetColorHandler(struct mg_rpc_request_info *ri, void *cb_arg,
                             struct mg_rpc_frame_info *fi, struct mg_str args) {
@@ -162,9 +279,8 @@ static void SetColorHandler(struct mg_rpc_request_info *ri, void *cb_arg,
   if (br_auto != -1) {
     mgos_sys_config_set_clock_br_auto((br_auto != 0));
   }
-  UpdateDisplay();
+  mgos_event_trigger((int) ConfigEvent::kChanged, nullptr);
   mg_rpc_send_responsef(ri, nullptr);
-  mgos_sys_config_save(&mgos_sys_config, false, nullptr);
 }
 
 static void RemoteButtonDownCB(int ev, void *ev_data, void *userdata) {
@@ -183,19 +299,14 @@ static void RemoteButtonUpCB(int ev, void *ev_data, void *userdata) {
   (void) ev;
 }
 
-static void ButtonCB(int pin, void *arg) {
-  switch (pin) {
-    case K1_GPIO:
-      LOG(LL_INFO, ("K1 (SET)"));
-      break;
-    case K2_GPIO:
-      LOG(LL_INFO, ("K2 (UP)"));
-      break;
-    case K3_GPIO:
-      LOG(LL_INFO, ("K3 (DOWN)"));
-      break;
-  }
-  (void) arg;
+static void ConfigChangedHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                 struct mg_rpc_frame_info *fi,
+                                 struct mg_str args) {
+  mgos_event_trigger((int) ConfigEvent::kChanged, nullptr);
+  mg_rpc_send_responsef(ri, nullptr);
+  (void) fi;
+  (void) cb_arg;
+  (void) args;
 }
 
 static void PeekHandler(struct mg_rpc_request_info *ri, void *cb_arg,
@@ -226,6 +337,312 @@ static void PokeHandler(struct mg_rpc_request_info *ri, void *cb_arg,
   (void) cb_arg;
 }
 
+static void BenchDisplayHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  int n = 1000;
+  json_scanf(args.p, args.len, ri->args_fmt, &n);
+  if (n <= 0) {
+    mg_rpc_send_errorf(ri, -1, "invalid %s", "n");
+    return;
+  }
+  int64_t full_us = 0, incr_us = 0;
+  BenchSetDigits(n, &full_us, &incr_us);
+  mg_rpc_send_responsef(
+      ri, "{n: %d, full_us: %d, incr_us: %d, full_ns: %d, incr_ns: %d}", n,
+      (int) full_us, (int) incr_us, (int) (full_us * 1000 / n),
+      (int) (incr_us * 1000 / n));
+  (void) fi;
+  (void) cb_arg;
+}
+
+static int PrintModelDigits(struct json_out *out, va_list *ap) {
+  const DisplayModel::Result *res = va_arg(*ap, const DisplayModel::Result *);
+  int len = json_printf(out, "[");
+  bool first = true;
+  for (int i = 0; i < DisplayModel::kNumSlots; i++) {
+    const DisplayModel::Digit &d = res->digits[i];
+    if (d.num_pulses == 0) continue;
+    len += json_printf(out,
+                       "%s{q: %d, val: %u, pulses: %u, r: %u, g: %u, b: %u}",
+                       (first ? "" : ", "), i - 2, d.val, d.num_pulses,
+                       d.lit[0], d.lit[1], d.lit[2]);
+    first = false;
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void DisplayCheckHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  DisplayModel::Result res;
+  if (!CheckDisplay(&res) || res.frame_len == 0) {
+    mg_rpc_send_errorf(ri, -1, "display is not running");
+    return;
+  }
+  mg_rpc_send_responsef(ri,
+                        "{frame_len: %u, refresh_hz: %u, in_sync: %B, "
+                        "ghost_ticks: %u, blank_ticks: %u, "
+                        "latch_while_lit: %u, digits: %M}",
+                        res.frame_len, 1000000 / res.frame_len, res.in_sync,
+                        res.ghost_ticks, res.blank_ticks, res.latch_while_lit,
+                        PrintModelDigits, &res);
+  (void) fi;
+  (void) cb_arg;
+  (void) args;
+}
+
+// Args: cpu_mhz, last, sum, count, max. Prints in ns.
+static int PrintCycleStats(struct json_out *out, va_list *ap) {
+  uint32_t cpu_mhz = va_arg(*ap, uint32_t);
+  uint32_t last = va_arg(*ap, uint32_t);
+  uint64_t sum = va_arg(*ap, uint64_t);
+  uint32_t count = va_arg(*ap, uint32_t);
+  uint32_t max = va_arg(*ap, uint32_t);
+  uint32_t avg = (count > 0 ? (uint32_t) (sum / count) : 0);
+  return json_printf(out, "{last: %u, avg: %u, max: %u}",
+                     last * 1000 / cpu_mhz, avg * 1000 / cpu_mhz,
+                     max * 1000 / cpu_mhz);
+}
+
+static int PrintJitterHist(struct json_out *out, va_list *ap) {
+  const DisplayStats *st = va_arg(*ap, const DisplayStats *);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < DisplayStats::kNumJitterBuckets; i++) {
+    len += json_printf(out, "%s%u", (i == 0 ? "" : ", "), st->jitter_hist[i]);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static void DisplayStatsHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                struct mg_rpc_frame_info *fi,
+                                struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  DisplayStats st;
+  GetDisplayStats(&st, reset);
+  if (st.cpu_mhz == 0 || st.num_frames == 0) {
+    mg_rpc_send_errorf(ri, -1, "display is not running");
+    return;
+  }
+  uint32_t period_ns = 0, refresh_mhz = 0;
+  if (st.num_periods > 0) {
+    uint64_t avg_cycles = st.period_cycles_sum / st.num_periods;
+    period_ns = (uint32_t) (avg_cycles * 1000 / st.cpu_mhz);
+    if (period_ns > 0) {
+      refresh_mhz = (uint32_t) (1000000000000ULL / period_ns);
+    }
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{frames: %u, loops: %u, swaps: %u, missed_swaps: %u, period_ns: %u, "
+      "refresh_mhz: %u, latency_ns: %M, dispatch_ns: %M, restart_ns: %M, "
+      "upload_ns: %M, jitter_hist: %M}",
+      st.num_frames, st.num_loops, st.num_swaps, st.num_missed_swaps, period_ns,
+      refresh_mhz, PrintCycleStats, st.cpu_mhz, st.latency_cycles_last,
+      st.latency_cycles_sum, st.num_periods, st.latency_cycles_max,
+      PrintCycleStats, st.cpu_mhz, st.dispatch_cycles_last,
+      st.dispatch_cycles_sum, st.num_frames, st.dispatch_cycles_max,
+      PrintCycleStats, st.cpu_mhz, st.restart_cycles_last,
+      st.restart_cycles_sum, st.num_frames, st.restart_cycles_max,
+      PrintCycleStats, st.cpu_mhz, st.upload_cycles_last,
+      st.upload_cycles_sum, st.num_frames, st.upload_cycles_max,
+      PrintJitterHist, &st);
+  (void) fi;
+  (void) cb_arg;
+}
+
+// Args: items, len. Lengths, negative for level 0.
+static int PrintIRItems(struct json_out *out, va_list *ap) {
+  const RMTItem *items = va_arg(*ap, const RMTItem *);
+  size_t len = va_arg(*ap, size_t);
+  int res = json_printf(out, "[");
+  for (size_t i = 0; i < len; i++) {
+    int v = (items[i].val ? items[i].num_cycles : -items[i].num_cycles);
+    res += json_printf(out, "%s%d", (i == 0 ? "" : ", "), v);
+  }
+  res += json_printf(out, "]");
+  return res;
+}
+
+static int PrintIRCaptures(struct json_out *out, va_list *ap) {
+  RMTItem items[RMTChannel::kMemLen];
+  int len = json_printf(out, "[");
+  bool first = true;
+  for (int i = 0; i < kNumIRCaptures; i++) {
+    size_t n = GetIRCapture(i, items, ARRAY_SIZE(items));
+    if (n == 0) continue;
+    len += json_printf(out, "%s%M", (first ? "" : ", "), PrintIRItems, items,
+                       n);
+    first = false;
+  }
+  len += json_printf(out, "]");
+  (void) ap;
+  return len;
+}
+
+static void IRCaptureHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                             struct mg_rpc_frame_info *fi,
+                             struct mg_str args) {
+  mg_rpc_send_responsef(ri, "{captures: %M}", PrintIRCaptures);
+  (void) fi;
+  (void) cb_arg;
+  (void) args;
+}
+
+// Parses items in the IRCapture format from the array at |path|.
+static size_t ParseIRItems(struct mg_str args, const char *path,
+                           RMTItem *items, size_t max_len) {
+  struct json_token t;
+  size_t len = 0;
+  for (int i = 0; len < max_len &&
+                  json_scanf_array_elem(args.p, args.len, path, i, &t) > 0;
+       i++) {
+    char buf[12];
+    if (t.len <= 0 || t.len >= (int) sizeof(buf)) return 0;
+    memcpy(buf, t.ptr, t.len);
+    buf[t.len] = '\0';
+    int v = std::strtol(buf, nullptr, 0);
+    if (v == 0 || v > 0x7fff || v < -0x7fff) return 0;
+    items[len].num_cycles = (v > 0 ? v : -v);
+    items[len].val = (v > 0);
+    len++;
+  }
+  return len;
+}
+
+// Max number of sequences in an IRBench corpus.
+static constexpr int kMaxIRBenchSeqs = 16;
+// Max number of iterations per sequence, keeps the totals and percentages
+// within int.
+static constexpr int kMaxIRBenchIter = 100000;
+static_assert((int64_t) kMaxIRBenchIter * kMaxIRBenchSeqs * 100 <= INT32_MAX,
+              "IRBench totals overflow");
+
+struct IRBenchSeqResult {
+  size_t len;
+  IRBenchResult res;
+};
+
+// Args: results, num results, num_iter.
+static int PrintIRBenchResults(struct json_out *out, va_list *ap) {
+  const IRBenchSeqResult *rs = va_arg(*ap, const IRBenchSeqResult *);
+  int n = va_arg(*ap, int);
+  int num_iter = va_arg(*ap, int);
+  int len = json_printf(out, "[");
+  for (int i = 0; i < n; i++) {
+    const IRBenchResult &res = rs[i].res;
+    len += json_printf(
+        out,
+        "%s{len: %d, ref: {ok: %B, proto: %Q, hold: %B, code: %u}, "
+        "ok: %d, wrong: %d, none: %d, ok_pct: %d, avg_ns: %u, max_ns: %u}",
+        (i == 0 ? "" : ", "), (int) rs[i].len, res.ref_ok,
+        (res.ref_ok ? IRProtocolName(res.ref.proto) : ""), res.ref.hold,
+        (unsigned) res.ref.code, res.num_ok, res.num_wrong, res.num_none,
+        res.num_ok * 100 / num_iter, res.avg_cycles * 1000 / res.cpu_mhz,
+        res.max_cycles * 1000 / res.cpu_mhz);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// Sequences to replay: |corpus| (array of item arrays), |items| (one
+// sequence) or a capture.
+static void IRBenchHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                           struct mg_rpc_frame_info *fi, struct mg_str args) {
+  IRBenchParams p = {.num_iter = 1000, .jitter_pct = 10, .noise_pct = 0,
+                     .trunc_pct = 0, .seed = 1};
+  int capture = 0;
+  json_scanf(args.p, args.len, ri->args_fmt, &p.num_iter, &p.jitter_pct,
+             &p.noise_pct, &p.trunc_pct, &p.seed, &capture);
+  if (p.num_iter <= 0 || p.num_iter > kMaxIRBenchIter || p.jitter_pct < 0 ||
+      p.jitter_pct > 90 || p.noise_pct < 0 || p.trunc_pct < 0) {
+    mg_rpc_send_errorf(ri, -1, "invalid args");
+    return;
+  }
+  IRBenchSeqResult rs[kMaxIRBenchSeqs];
+  RMTItem items[RMTChannel::kMemLen];
+  int n = 0;
+  for (; n < kMaxIRBenchSeqs; n++) {
+    char path[20];
+    snprintf(path, sizeof(path), ".corpus[%d]", n);
+    size_t len = ParseIRItems(args, path, items, ARRAY_SIZE(items));
+    if (len == 0) break;
+    rs[n].len = len;
+    BenchIRDecoder(items, len, p, &rs[n].res);
+  }
+  if (n == 0) {
+    size_t len = ParseIRItems(args, ".items", items, ARRAY_SIZE(items));
+    if (len == 0) len = GetIRCapture(capture, items, ARRAY_SIZE(items));
+    if (len == 0) {
+      mg_rpc_send_errorf(ri, -1, "no items");
+      return;
+    }
+    rs[0].len = len;
+    BenchIRDecoder(items, len, p, &rs[0].res);
+    n = 1;
+  }
+  int num_ok = 0, num_wrong = 0, num_none = 0;
+  for (int i = 0; i < n; i++) {
+    num_ok += rs[i].res.num_ok;
+    num_wrong += rs[i].res.num_wrong;
+    num_none += rs[i].res.num_none;
+  }
+  mg_rpc_send_responsef(
+      ri, "{n: %d, ok: %d, wrong: %d, none: %d, ok_pct: %d, seqs: %M}",
+      p.num_iter, num_ok, num_wrong, num_none,
+      num_ok * 100 / (p.num_iter * n), PrintIRBenchResults, rs, n,
+      p.num_iter);
+  (void) fi;
+  (void) cb_arg;
+}
+
+// Args: last, sum, count, max.
+static int PrintLatencyStats(struct json_out *out, va_list *ap) {
+  uint32_t last = va_arg(*ap, uint32_t);
+  uint64_t sum = va_arg(*ap, uint64_t);
+  uint32_t count = va_arg(*ap, uint32_t);
+  uint32_t max = va_arg(*ap, uint32_t);
+  uint32_t avg = (count > 0 ? (uint32_t) (sum / count) : 0);
+  return json_printf(out, "{count: %u, last: %u, avg: %u, max: %u}", count,
+                     last, avg, max);
+}
+
+static void InputStatsHandler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  bool reset = false;
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  InputStats st;
+  GetInputStats(&st, reset);
+  mg_rpc_send_responsef(
+      ri,
+      "{ir_events: %u, btn_events: %u, dropped: %u, batches: %u, "
+      "max_batch: %u, ir_latency_us: %M, btn_latency_us: %M}",
+      st.num_ir_events, st.num_btn_events, st.num_dropped, st.num_batches,
+      st.max_batch, PrintLatencyStats, st.ir_latency_us_last,
+      st.ir_latency_us_sum, st.num_ir_codes, st.ir_latency_us_max,
+      PrintLatencyStats, st.btn_latency_us_last, st.btn_latency_us_sum,
+      st.num_btn_presses, st.btn_latency_us_max);
+  (void) fi;
+  (void) cb_arg;
+}
+
+// Startup is staged so that the display comes up as soon as possible.
+// Stage 1, called from mgos_app_init: start the display without doing any
+// I/O. It shows the time if it has survived the reset in the RTC,
+// placeholder otherwise, brightness is fixed until the sensor is up.
+void InitDisplay() {
+  ApplyConfig();
+  mgos_event_add_handler(MGOS_EVENT_TIME_CHANGED, TimeChangedCB, nullptr);
+  UpdateDisplay();
+  LOG(LL_INFO, ("First frame at %d ms since boot",
+                (int) (esp_timer_get_time() / 1000)));
+}
+
+// Stage 2, runs from the main loop once the system is up: everything else.
 void InitApp(void *arg UNUSED_ARG) {
   LOG(LL_INFO, ("Board: %s", CS_STRINGIFY_MACRO(BOARD)));
 
@@ -234,37 +651,35 @@ void InitApp(void *arg UNUSED_ARG) {
       "{s: %Q, r: %d, g: %d, b: %d, rc: %d, gc: %d, bc: %d, d: %d, "
       "br: %d, br_auto: %B}",
       SetColorHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.ConfigChanged", "",
+                     ConfigChangedHandler, nullptr);
   mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.Peek", "{addr: %u}",
                      PeekHandler, nullptr);
   mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.Poke", "{addr: %u, val: %u}",
                      PokeHandler, nullptr);
-
-#ifdef DVI_GPIO
-  // Reset the light sensor.
-  mgos_gpio_setup_output(DVI_GPIO, 0);
-  mgos_msleep(1);
-  mgos_gpio_write(DVI_GPIO, 1);
-#endif
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.BenchDisplay", "{n: %d}",
+                     BenchDisplayHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.DisplayCheck", "",
+                     DisplayCheckHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.DisplayStats",
+                     "{reset: %B}", DisplayStatsHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.IRCapture", "",
+                     IRCaptureHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.IRBench",
+                     "{n: %d, jitter: %d, noise: %d, trunc: %d, seed: %u, "
+                     "capture: %d}",
+                     IRBenchHandler, nullptr);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "Clock.InputStats", "{reset: %B}",
+                     InputStatsHandler, nullptr);
 
   mgos_gpio_set_mode(BUZZ_GPIO, MGOS_GPIO_MODE_OUTPUT_OD);
   mgos_gpio_write(BUZZ_GPIO, 1);
 
-  struct mgos_i2c *i2c_bus = mgos_i2c_get_bus(0);
-  uint8_t bh1750_addr = mgos_bh1750_detect_i2c(i2c_bus);
-  if (bh1750_addr != 0) {
-    LOG(LL_INFO, ("Found BH1750 sensor at %#x", bh1750_addr));
-    s_bh = mgos_bh1750_create(bh1750_addr);
-    mgos_bh1750_set_config(s_bh, MGOS_BH1750_MODE_CONT_HIGH_RES_2,
-                           mgos_sys_config_get_clock_bh1750_mtime());
-  } else if (mgos_veml7700_detect(i2c_bus)) {
-    LOG(LL_INFO, ("Found VEML7700 sensor"));
-    s_veml = mgos_veml7700_create(i2c_bus);
-    mgos_veml7700_set_cfg(
-        s_veml, MGOS_VEML7700_CFG_ALS_IT_100 | MGOS_VEML7700_CFG_ALS_GAIN_1,
-        MGOS_VEML7700_PSM_0);
-  } else {
-    LOG(LL_ERROR, ("No light sensor found!"));
-  }
+#ifdef DVI_GPIO
+  LightSensorInit(mgos_i2c_get_bus(0), DVI_GPIO);
+#else
+  LightSensorInit(mgos_i2c_get_bus(0));
+#endif
 
   RemoteControlInit();
   mgos_event_add_handler((int) RemoteControlButtonEvent::kButtonDown,
@@ -272,23 +687,16 @@ void InitApp(void *arg UNUSED_ARG) {
   mgos_event_add_handler((int) RemoteControlButtonEvent::kButtonUp,
                          RemoteButtonUpCB, nullptr);
 
-  mgos_gpio_set_button_handler(K1_GPIO, MGOS_GPIO_PULL_UP,
-                               MGOS_GPIO_INT_EDGE_NEG, 20, ButtonCB, nullptr);
-  mgos_gpio_set_button_handler(K2_GPIO, MGOS_GPIO_PULL_UP,
-                               MGOS_GPIO_INT_EDGE_NEG, 20, ButtonCB, nullptr);
-  mgos_gpio_set_button_handler(K3_GPIO, MGOS_GPIO_PULL_UP,
-                               MGOS_GPIO_INT_EDGE_NEG, 20, ButtonCB, nullptr);
-
-  s_tmr.Reset(1000, MGOS_TIMER_REPEAT);
-
-  s_rlc = mgos_sys_config_get_clock_rl();
-  s_glc = mgos_sys_config_get_clock_gl();
-  s_blc = mgos_sys_config_get_clock_bl();
+  mgos_event_add_handler((int) ConfigEvent::kChanged, ConfigChangedCB,
+                         nullptr);
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, FlushConfigCB, nullptr);
+  mgos_event_add_handler(MGOS_EVENT_OTA_BEGIN, FlushConfigCB, nullptr);
 }
 
 }  // namespace clk
 
 extern "C" enum mgos_app_init_result mgos_app_init(void) {
-  mgos_set_timer(5000, 0, clk::InitApp, nullptr);
+  clk::InitDisplay();
+  mgos_set_timer(0, 0, clk::InitApp, nullptr);
   return MGOS_APP_INIT_SUCCESS;
 }
@@ -5,154 +5,199 @@
 
 #include "clk_remote_control.hpp"
 
-#include <cmath>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
-#include <map>
-#include <string>
+#include <cstring>
 
 #include "mgos.hpp"
+#include "mgos_timers.hpp"
 
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "clk_config.hpp"
+#include "clk_ir_decoder.hpp"
 #include "clk_rmt_input_channel.hpp"
+#include "clk_spsc_queue.hpp"
 
 namespace clk {
 
-static constexpr uint16_t kBtnCodeHold = 0;              // "Button held down"
 static constexpr int kBtnHoldMaxAgeMicros = 1000000;     // 1 second
 static constexpr int kBtnReleaseTimeoutMicros = 200000;  // 200 ms
+static constexpr int kBtnDebounceMicros = 20000;         // 20 ms
 static constexpr int kTimerPeriodMs = 50;                // 100 ms
+// Input task runs above the main task (priority 5).
+static constexpr int kInputTaskPriority = 6;
+static constexpr int kInputTaskStackSize = 4096;
 
-static RMTInputChannel s_ir_ch(7, IR_GPIO, false, 1, 50, 20000);
+// Idle threshold is above the longest level in a code of any protocol (NEC
+// header mark) and below the gap between codes.
+static constexpr uint16_t kIRIdleThreshUs = 12000;
+static_assert(kIRIdleThreshUs > kIRMaxItemLen,
+              "IR idle threshold must be above the longest item");
+static RMTInputChannel s_ir_ch(7, IR_GPIO, false, 1, 50, kIRIdleThreshUs);
+// Button state, owned by the input task.
 static RemoteControlButton s_last_btn = RemoteControlButton::kNone;
 static int64_t s_last_btn_ts = 0;
 static int64_t s_last_ev_ts = 0;
 static int s_ev_count = 0;
-typedef std::map<uint16_t, RemoteControlButton> ButtonMap;
-static ButtonMap s_btn_map;
-
-static void TimerCB();
-static mgos::Timer s_timer_(TimerCB);
-
-static bool ApproxEq(uint32_t val, uint32_t exp) {
-  float vf = (float) val;
-  float ef = (float) exp;
-  return std::fabs(vf - ef) < 0.15f * exp;
-}
-
-// Parse 8-bit calibration sequence.
-static bool ParseCalibSeq(const RMTChannel::Item *data, size_t *avg_lo,
-                          size_t *avg_hi) {
-  if (data[0].val != 0) return false;
-  // All ticks should be about the same.
-  uint32_t sum_lo = 0, sum_hi = 0;
-  for (size_t i = 0; i <= 14; i += 2) {
-    if (i <= 12) {
-      LOG(LL_VERBOSE_DEBUG,
-          ("%d | %d %d | %d %d", i, data[i].num_cycles, data[i + 2].num_cycles,
-           data[i + 1].num_cycles, data[i + 3].num_cycles));
-      if (!ApproxEq(data[i].num_cycles, data[i + 2].num_cycles)) return false;
-      if (!ApproxEq(data[i + 1].num_cycles, data[i + 3].num_cycles))
-        return false;
-    }
-    sum_lo += data[i].num_cycles;
-    sum_hi += data[i + 1].num_cycles;
+
+// Button map, compiled from the config string. Entries are sorted by key
+// (protocol << 32 | code).
+static constexpr int kMaxButtonMapEntries = 32;
+struct ButtonMapEntry {
+  uint64_t key;
+  RemoteControlButton btn;
+};
+struct ButtonMap {
+  int num_entries;
+  ButtonMapEntry entries[kMaxButtonMapEntries];
+};
+// The main task builds s_btn_maps[gen & 1] for the next generation and
+// publishes it in s_btn_map_gen. The input task picks up the current
+// generation at the start of each round and acknowledges it in
+// s_btn_map_ack, after that the other map is not used and can be rebuilt.
+static ButtonMap s_btn_maps[2];
+static std::atomic<uint32_t> s_btn_map_gen{0}, s_btn_map_ack{0};
+// Map used by the input task in the current round.
+static const ButtonMap *s_btn_map = &s_btn_maps[0];
+// Config string the map was built from.
+static char *s_btn_map_spec = nullptr;
+
+// Input event, timestamped in the interrupt handler.
+struct InputEvent {
+  // Microseconds, low 32 bits of esp_timer_get_time().
+  uint32_t ts;
+  // IR: number of items.
+  uint16_t len;
+  // Buttons: pin and level.
+  uint8_t pin, level;
+};
+
+// Received items and receptions, filled by the RMT interrupt handler.
+static SPSCQueue<RMTChannel::Item, 512> s_ir_items;
+static SPSCQueue<InputEvent, 16> s_ir_evs;
+// Button edges, filled by the GPIO interrupt handler.
+static SPSCQueue<InputEvent, 32> s_btn_evs;
+// Incremented by the interrupt handlers, read and reset by GetInputStats.
+static std::atomic<uint32_t> s_ir_dropped{0}, s_btn_dropped{0};
+static TaskHandle_t s_input_task = nullptr;
+static InputStats s_input_stats;
+// Set by GetInputStats, the input task resets the stats.
+static std::atomic<bool> s_reset_input_stats{false};
+static IRDecoder s_ir_dec;
+
+// Local buttons, active low.
+struct LocalButton {
+  int pin;
+  RemoteControlButton btn;
+  bool pressed;
+  // Edges are being debounced, since |first_ts| until |last_ts|.
+  bool pending;
+  uint32_t first_ts, last_ts;
+};
+static LocalButton s_local_btns[] = {
+    {K1_GPIO, RemoteControlButton::kSet},
+    {K2_GPIO, RemoteControlButton::kUp},
+    {K3_GPIO, RemoteControlButton::kDown},
+};
+
+struct IRCapture {
+  uint16_t len;
+  RMTChannel::Item items[RMTChannel::kMemLen];
+};
+// Last receptions, s_ir_caps[s_ir_cap_idx] is the most recent.
+static IRCapture s_ir_caps[kNumIRCaptures];
+static int s_ir_cap_idx = 0;
+
+static void UpdateLatency(uint32_t lat, uint32_t *last, uint32_t *max,
+                          uint64_t *sum, uint32_t *count) {
+  *last = lat;
+  if (lat > *max) *max = lat;
+  *sum += lat;
+  (*count)++;
+}
+
+// Button event packed into the callback argument: button, repeat flag,
+// up flag.
+static constexpr uintptr_t kBtnEvRepeat = 0x100;
+static constexpr uintptr_t kBtnEvUp = 0x200;
+
+// Event handlers are not thread-safe, events are triggered on the main task.
+static void TriggerButtonEventCB(void *arg) {
+  uintptr_t ev = (uintptr_t) arg;
+  RemoteControlButton btn = (RemoteControlButton) (ev & 0xff);
+  if (ev & kBtnEvUp) {
+    RemoteControlButtonUpEventArg arg = {.btn = btn};
+    mgos_event_trigger((int) RemoteControlButtonEvent::kButtonUp, &arg);
+  } else {
+    RemoteControlButtonDownEventArg arg = {
+        .btn = btn, .repeat = ((ev & kBtnEvRepeat) != 0)};
+    mgos_event_trigger((int) RemoteControlButtonEvent::kButtonDown, &arg);
   }
-  *avg_lo = sum_lo / 8;
-  *avg_hi = sum_hi / 8;
-  return true;
 }
 
-static mgos::StatusOr<uint16_t> DecodeSequence(const RMTChannel::Item *data,
-                                               size_t len) {
-  if (len == 2) {
-    if (ApproxEq(data[0].num_cycles, 2200) &&
-        ApproxEq(data[1].num_cycles, 550)) {
-      return kBtnCodeHold;
-    } else {
-      return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Invalid short sequence");
+static void TriggerButtonEvent(RemoteControlButton btn, bool up,
+                               bool repeat) {
+  uintptr_t ev = ((uintptr_t) btn | (up ? kBtnEvUp : 0) |
+                  (repeat ? kBtnEvRepeat : 0));
+  mgos_invoke_cb(TriggerButtonEventCB, (void *) ev, false /* from_isr */);
+}
+
+static void SetButton(RemoteControlButton btn, int64_t now) {
+  if (btn != s_last_btn) {
+    if (s_last_btn != RemoteControlButton::kNone) {
+      TriggerButtonEvent(s_last_btn, true /* up */, false /* repeat */);
     }
-  } else if (len != 66) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Unexpected sequence length");
-  }
-  const auto *p = data;
-  // First is a prologue: a positive pulse of about 4.5 ms
-  if (p->val != 1 || !ApproxEq(p->num_cycles, 4500)) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Invalid prologue");
-  }
-  p++;
-  // Parse the "0" calibration sequence.
-  uint32_t lo0 = 0, hi0 = 0;
-  if (!ParseCalibSeq(p, &lo0, &hi0)) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Invalid 0 cal seq");
-  }
-  p += 16;
-  // Parse the "1" calibration sequence.
-  uint32_t lo1 = 0, hi1 = 0;
-  if (!ParseCalibSeq(p, &lo1, &hi1)) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Invalid 1 cal seq");
-  }
-  p += 16;
-  LOG(LL_VERBOSE_DEBUG, ("0: %d %d | 1: %d %d", lo0, hi0, lo1, hi1));
-  // Low should be abot the same in both cases.
-  if (!ApproxEq(lo0, lo1)) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT,
-                        "Different 0 and 1 cal sequences");
-  }
-  // "1" must be different from "0".
-  if (ApproxEq(hi0, hi1)) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "0 and 1 are the same");
-  }
-  p++;
-  // Decode the sequence, extract key code.
-  uint16_t code = 0, num_1 = 0;
-  for (uint16_t i = 0, mask = 0x8000; i < 16; i++, mask >>= 1, p += 2) {
-    LOG(LL_VERBOSE_DEBUG, ("%d | %d %d", i, p->val, p->num_cycles));
-    if (ApproxEq(p->num_cycles, hi1)) {
-      code |= mask;
-      num_1++;
-    } else if (!ApproxEq(p->num_cycles, hi0)) {
-      return mgos::Errorf(STATUS_INVALID_ARGUMENT, "bad pulse at pos %d", i);
+    if (btn != RemoteControlButton::kNone) {
+      TriggerButtonEvent(btn, false /* up */, false /* repeat */);
+      s_ev_count = 1;
+      s_last_ev_ts = now;
     }
+    s_last_btn = btn;
   }
-  if (num_1 != 8) {
-    return mgos::Errorf(STATUS_INVALID_ARGUMENT, "expected 8 x 1s, got %d",
-                        num_1);
+  if (btn != RemoteControlButton::kNone) {
+    s_last_btn_ts = now;
   }
-  return code;
 }
 
-static void TimerCB() {
-  if (s_last_btn == RemoteControlButton::kNone) {
-    s_timer_.Clear();
-    return;
-  }
-  int64_t now = mgos_uptime_micros();
+// Repeats and releases the button that is being held.
+static void CheckButtonRepeat(int64_t now) {
+  if (s_last_btn == RemoteControlButton::kNone) return;
   if (now - s_last_btn_ts > kBtnReleaseTimeoutMicros) {
-    RemoteControlButtonUpEventArg arg = {.btn = s_last_btn};
-    mgos_event_trigger((int) RemoteControlButtonEvent::kButtonUp, &arg);
-    s_timer_.Clear();
-    s_last_btn = RemoteControlButton::kNone;
+    SetButton(RemoteControlButton::kNone, now);
     return;
   }
   int64_t repeat_wait = std::max(1000000 / s_ev_count, 100000);
   if (now - s_last_ev_ts < repeat_wait) return;
-  RemoteControlButtonDownEventArg arg = {.btn = s_last_btn, .repeat = true};
-  mgos_event_trigger((int) RemoteControlButtonEvent::kButtonDown, &arg);
+  TriggerButtonEvent(s_last_btn, false /* up */, true /* repeat */);
   s_last_ev_ts = now;
   s_ev_count++;
 }
 
-static void ProcessSequence() {
-  auto st = DecodeSequence(s_ir_ch.data(), s_ir_ch.len());
-  if (!st.ok()) {
-    const auto ms = st.status().ToString();
-    LOG(LL_DEBUG, ("Invalid control sequence: %s", ms.c_str()));
-    // s_ir_ch.Dump();
-    return;
-  }
-  uint16_t code = st.ValueOrDie();
-  int64_t now = mgos_uptime_micros();
+static uint64_t ButtonMapKey(IRProtocol proto, uint32_t code) {
+  return (((uint64_t) proto) << 32) | code;
+}
+
+static bool EntryKeyLess(const ButtonMapEntry &en, uint64_t key) {
+  return en.key < key;
+}
+
+static RemoteControlButton LookupButton(const ButtonMap &map, uint64_t key) {
+  const ButtonMapEntry *b = map.entries, *e = b + map.num_entries;
+  const ButtonMapEntry *it = std::lower_bound(b, e, key, EntryKeyLess);
+  return (it != e && it->key == key ? it->btn : RemoteControlButton::kNone);
+}
+
+static void ProcessCode(const IRCode &code, int64_t now) {
   RemoteControlButton btn = RemoteControlButton::kNone;
-  if (code == kBtnCodeHold) {
+  if (!code.hold) {
+    LOG(LL_DEBUG, ("IR code %s:0x%lx", IRProtocolName(code.proto),
+                   (unsigned long) code.code));
+  }
+  if (code.hold) {
     if (s_last_btn != RemoteControlButton::kNone &&
         (now - s_last_btn_ts < kBtnHoldMaxAgeMicros)) {
       btn = s_last_btn;
@@ -160,96 +205,315 @@ static void ProcessSequence() {
       return;
     }
   } else {
-    const auto &it = s_btn_map.find(code);
-    if (it != s_btn_map.end()) {
-      btn = it->second;
-    }
+    btn = LookupButton(*s_btn_map, ButtonMapKey(code.proto, code.code));
   }
-  if (btn != s_last_btn) {
-    if (s_last_btn != RemoteControlButton::kNone) {
-      RemoteControlButtonUpEventArg arg = {.btn = s_last_btn};
-      mgos_event_trigger((int) RemoteControlButtonEvent::kButtonUp, &arg);
+  SetButton(btn, now);
+}
+
+// Decodes queued receptions. Returns the number of events processed.
+static int ProcessIREvents(int64_t now) {
+  int n = 0;
+  InputEvent ev;
+  while (s_ir_evs.Pop(&ev)) {
+    IRCapture &cap = s_ir_caps[(s_ir_cap_idx + 1) % kNumIRCaptures];
+    cap.len = 0;
+    bool decoded = false;
+    IRCode code;
+    for (int i = 0; i < ev.len; i++) {
+      RMTChannel::Item it;
+      if (!s_ir_items.Pop(&it)) break;
+      if (cap.len < ARRAY_SIZE(cap.items)) cap.items[cap.len++] = it;
+      if (s_ir_dec.Feed(it, &code)) {
+        ProcessCode(code, now);
+        decoded = true;
+      }
     }
-    if (btn != RemoteControlButton::kNone) {
-      RemoteControlButtonDownEventArg arg = {.btn = btn, .repeat = false};
-      mgos_event_trigger((int) RemoteControlButtonEvent::kButtonDown, &arg);
-      s_ev_count = 1;
-      s_last_ev_ts = now;
-      s_timer_.Reset(kTimerPeriodMs, MGOS_TIMER_REPEAT);
+    // End of reception, nothing can continue across it.
+    if (s_ir_dec.End(&code)) {
+      ProcessCode(code, now);
+      decoded = true;
     }
-    s_last_btn = btn;
+    s_ir_cap_idx = (s_ir_cap_idx + 1) % kNumIRCaptures;
+    InputStats &st = s_input_stats;
+    st.num_ir_events++;
+    if (decoded) {
+      UpdateLatency((uint32_t) now - ev.ts, &st.ir_latency_us_last,
+                    &st.ir_latency_us_max, &st.ir_latency_us_sum,
+                    &st.num_ir_codes);
+    }
+    n++;
   }
-  if (btn != RemoteControlButton::kNone) {
-    s_last_btn_ts = now;
-  } else {
-    s_timer_.Clear();
+  return n;
+}
+
+// Queued button edges start or extend debouncing.
+static int ProcessButtonEvents() {
+  int n = 0;
+  InputEvent ev;
+  while (s_btn_evs.Pop(&ev)) {
+    for (auto &b : s_local_btns) {
+      if (b.pin != ev.pin) continue;
+      if (!b.pending) b.first_ts = ev.ts;
+      b.pending = true;
+      b.last_ts = ev.ts;
+    }
+    s_input_stats.num_btn_events++;
+    n++;
   }
+  return n;
 }
 
-static void IRRMTIntHandler2(void *arg) {
-  s_ir_ch.Download();
-  LOG(LL_VERBOSE_DEBUG, ("Downloaded %d items", (int) s_ir_ch.len()));
-  ProcessSequence();
-  s_ir_ch.Clear(true /* buf */, true /* mem */);
-  mgos_gpio_enable_int(IR_GPIO);
+// Dispatches debounced button state changes.
+// Returns the time until the next debounce deadline, -1 if none.
+static int CheckLocalButtons(int64_t now) {
+  int next = -1;
+  for (auto &b : s_local_btns) {
+    if (b.pending) {
+      uint32_t elapsed = (uint32_t) now - b.last_ts;
+      if (elapsed < (uint32_t) kBtnDebounceMicros) {
+        int left = kBtnDebounceMicros - elapsed;
+        if (next < 0 || left < next) next = left;
+        continue;
+      }
+      b.pending = false;
+      bool pressed = !mgos_gpio_read(b.pin);
+      if (pressed != b.pressed) {
+        b.pressed = pressed;
+        InputStats &st = s_input_stats;
+        UpdateLatency((uint32_t) now - b.first_ts, &st.btn_latency_us_last,
+                      &st.btn_latency_us_max, &st.btn_latency_us_sum,
+                      &st.num_btn_presses);
+        if (pressed) {
+          SetButton(b.btn, now);
+        } else if (s_last_btn == b.btn) {
+          SetButton(RemoteControlButton::kNone, now);
+        }
+      }
+    }
+    // Held down, not released by timeout.
+    if (b.pressed && s_last_btn == b.btn) s_last_btn_ts = now;
+  }
+  return next;
+}
+
+static void InputTask(void *arg) {
+  TickType_t wait = portMAX_DELAY;
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, wait);
+    uint32_t gen = s_btn_map_gen.load(std::memory_order_acquire);
+    s_btn_map = &s_btn_maps[gen & 1];
+    s_btn_map_ack.store(gen, std::memory_order_release);
+    if (s_reset_input_stats.exchange(false)) s_input_stats = {};
+    int64_t now = esp_timer_get_time();
+    int n = ProcessIREvents(now) + ProcessButtonEvents();
+    int debounce_us = CheckLocalButtons(now);
+    CheckButtonRepeat(now);
+    if (n > 0) {
+      InputStats &st = s_input_stats;
+      st.num_batches++;
+      if ((uint32_t) n > st.max_batch) st.max_batch = n;
+    }
+    // Round up, wake up at least once per tick.
+    wait = portMAX_DELAY;
+    if (debounce_us >= 0) {
+      wait = pdMS_TO_TICKS(debounce_us / 1000) + 1;
+    }
+    if (s_last_btn != RemoteControlButton::kNone) {
+      wait = std::min<TickType_t>(wait, pdMS_TO_TICKS(kTimerPeriodMs));
+    }
+  }
   (void) arg;
 }
 
+IRAM static void NotifyInputTask() {
+  BaseType_t hpw = pdFALSE;
+  vTaskNotifyGiveFromISR(s_input_task, &hpw);
+  if (hpw) portYIELD_FROM_ISR();
+}
+
+// Called at the end of each sequence (when the line has been idle for the
+// idle threshold). Receiver is never stopped: the sequence is queued and
+// reception is re-armed right away.
 IRAM static void IRRMTIntHandler(RMTChannel *ch, void *arg) {
-  s_ir_ch.Stop();
-  s_ir_ch.Detach();
-  mgos_invoke_cb(IRRMTIntHandler2, nullptr, true /* from_isr */);
+  s_ir_ch.Download();
+  // Reset the write pointer, next sequence goes to the start of the memory.
+  s_ir_ch.Start();
+  size_t len = s_ir_ch.len();
+  if (len == 0) return;
+  InputEvent ev = {.ts = (uint32_t) esp_timer_get_time(),
+                   .len = (uint16_t) len};
+  // Single producer, if there is space for the event now, there will be
+  // after the items are pushed.
+  if (s_ir_evs.Free() == 0 || !s_ir_items.PushN(s_ir_ch.data(), len)) {
+    s_ir_dropped++;
+    return;
+  }
+  s_ir_evs.Push(ev);
+  NotifyInputTask();
   (void) ch;
   (void) arg;
 }
 
-IRAM static void IRGPIOIntHandler(int pin, void *arg) {
-  mgos_gpio_disable_int(IR_GPIO);
-  s_ir_ch.Attach();
-  s_ir_ch.ClearInt();
-  s_ir_ch.EnableInt();
-  s_ir_ch.Start();
-  (void) pin;
+IRAM static void LocalButtonIntHandler(int pin, void *arg) {
+  InputEvent ev = {.ts = (uint32_t) esp_timer_get_time(),
+                   .len = 0,
+                   .pin = (uint8_t) pin,
+                   .level = (uint8_t) mgos_gpio_read(pin)};
+  if (!s_btn_evs.Push(ev)) {
+    s_btn_dropped++;
+    return;
+  }
+  NotifyInputTask();
   (void) arg;
 }
 
-static mgos::StatusOr<ButtonMap> ParseButtonMap(const char *map_spec) {
-  ButtonMap btn_map;
-  const char *p = map_spec;
+// Parses an unsigned number from |s| (not NUL-terminated).
+static bool ParseNum(struct mg_str s, uint64_t max, uint64_t *val) {
+  char buf[24];
+  if (s.len == 0 || s.len >= sizeof(buf)) return false;
+  memcpy(buf, s.p, s.len);
+  buf[s.len] = '\0';
+  char *end = nullptr;
+  unsigned long long v = std::strtoull(buf, &end, 0);
+  if (*end != '\0' || v > max) return false;
+  *val = v;
+  return true;
+}
+
+// Adds or replaces the entry, keeping the map sorted.
+static bool AddButtonMapEntry(ButtonMap *map, uint64_t key,
+                              RemoteControlButton btn) {
+  ButtonMapEntry *b = map->entries, *e = b + map->num_entries;
+  ButtonMapEntry *it = std::lower_bound(b, e, key, EntryKeyLess);
+  if (it == e || it->key != key) {
+    if (map->num_entries == kMaxButtonMapEntries) return false;
+    std::move_backward(it, e, e + 1);
+    map->num_entries++;
+  }
+  *it = {key, btn};
+  return true;
+}
+
+// Parses "[protocol:]code=id,..." into |*map|, without allocations.
+static mgos::Status ParseButtonMap(const char *map_spec, ButtonMap *map) {
+  map->num_entries = 0;
+  const char *p = (map_spec != nullptr ? map_spec : "");
   struct mg_str key, val;
   while ((p = mg_next_comma_list_entry(p, &key, &val)) != NULL) {
-    std::string ks(key.p, key.len), vs(val.p, val.len);
-    char *kend = nullptr, *vend = nullptr;
-    int code = std::strtol(ks.c_str(), &kend, 0);
-    int id = std::strtol(vs.c_str(), &vend, 0);
-    if (*kend != '\0' || *vend != '\0' || code <= 0 || code > 0xffff ||
-        id < 0 || id >= (int) RemoteControlButton::kMax) {
+    // Key is [protocol:]code, native protocol by default.
+    IRProtocol proto = IRProtocol::kNative;
+    struct mg_str cs = key;
+    const char *colon = (const char *) memchr(key.p, ':', key.len);
+    bool ok = true;
+    if (colon != nullptr) {
+      ok = IRProtocolFromName(key.p, colon - key.p, &proto);
+      cs = mg_mk_str_n(colon + 1, key.len - (colon + 1 - key.p));
+    }
+    uint64_t code = 0, id = 0;
+    uint64_t max_code = (proto == IRProtocol::kNative ? 0xffff : 0xffffffff);
+    ok = ok && ParseNum(cs, max_code, &code) &&
+         ParseNum(val, (int) RemoteControlButton::kMax - 1, &id);
+    // Native code 0 is the hold code.
+    if (!ok || (proto == IRProtocol::kNative && code == 0)) {
       return mgos::Errorf(STATUS_INVALID_ARGUMENT,
-                          "Invalid button map entry %s=%s", ks.c_str(),
-                          vs.c_str());
+                          "Invalid button map entry %.*s=%.*s", (int) key.len,
+                          key.p, (int) val.len, val.p);
+    }
+    if (!AddButtonMapEntry(map, ButtonMapKey(proto, code),
+                           static_cast<RemoteControlButton>(id))) {
+      return mgos::Errorf(STATUS_RESOURCE_EXHAUSTED,
+                          "Too many button map entries (max %d)",
+                          kMaxButtonMapEntries);
     }
-    btn_map[code] = static_cast<RemoteControlButton>(id);
   }
-  if (btn_map.empty()) {
+  if (map->num_entries == 0) {
     return mgos::Errorf(STATUS_INVALID_ARGUMENT, "Empty button map");
   }
-  return btn_map;
+  return mgos::Status::OK();
 }
 
-void RemoteControlInit() {
-  auto stv = ParseButtonMap(mgos_sys_config_get_clock_remote_button_map());
-  if (stv.ok()) {
-    s_btn_map = stv.ValueOrDie();
-  } else {
-    const auto &s = stv.status().ToString();
+static void UpdateButtonMap();
+static mgos::Timer s_btn_map_tmr(UpdateButtonMap);
+
+// Rebuilds the map if the config string has changed. Other settings change
+// much more often and there is no need to rebuild the map every time.
+static void UpdateButtonMap() {
+  const char *spec = mgos_sys_config_get_clock_remote_button_map();
+  if (spec == nullptr) spec = "";
+  if (s_btn_map_spec != nullptr && strcmp(spec, s_btn_map_spec) == 0) return;
+  uint32_t gen = s_btn_map_gen.load(std::memory_order_relaxed);
+  // Input task has not switched to the last map yet and may still be using
+  // the one that would be rebuilt. Try again later.
+  if (s_btn_map_ack.load(std::memory_order_acquire) != gen) {
+    s_btn_map_tmr.Reset(kTimerPeriodMs, 0);
+    return;
+  }
+  free(s_btn_map_spec);
+  s_btn_map_spec = strdup(spec);
+  ButtonMap *map = &s_btn_maps[(gen + 1) & 1];
+  auto st = ParseButtonMap(spec, map);
+  if (!st.ok()) {
+    map->num_entries = 0;
+    const auto &s = st.ToString();
     LOG(LL_ERROR, ("Invalid button map: %s", s.c_str()));
+  } else {
+    LOG(LL_INFO, ("Button map: %d entries", map->num_entries));
+  }
+  s_btn_map_gen.store(gen + 1, std::memory_order_release);
+  // Make the input task switch now.
+  if (s_input_task != nullptr) xTaskNotifyGive(s_input_task);
+}
+
+static void ConfigChangedCB(int ev, void *ev_data, void *userdata) {
+  UpdateButtonMap();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+size_t GetIRCapture(int idx, RMTItem *items, size_t max_len) {
+  if (idx < 0 || idx >= kNumIRCaptures) return 0;
+  const IRCapture &cap =
+      s_ir_caps[(s_ir_cap_idx + kNumIRCaptures - idx) % kNumIRCaptures];
+  size_t len = std::min<size_t>(cap.len, max_len);
+  memcpy(items, cap.items, len * sizeof(*items));
+  return len;
+}
+
+void GetInputStats(InputStats *st, bool reset) {
+  // Counters are updated by the input task, copy may be slightly
+  // inconsistent but that is fine for statistics.
+  *st = s_input_stats;
+  if (reset) {
+    s_reset_input_stats = true;
+    st->num_dropped = s_ir_dropped.exchange(0) + s_btn_dropped.exchange(0);
+  } else {
+    st->num_dropped = s_ir_dropped.load() + s_btn_dropped.load();
+  }
+}
+
+void RemoteControlInit() {
+  UpdateButtonMap();
+  mgos_event_add_handler((int) ConfigEvent::kChanged, ConfigChangedCB,
+                         nullptr);
+  if (xTaskCreate(InputTask, "input", kInputTaskStackSize, nullptr,
+                  kInputTaskPriority, &s_input_task) != pdPASS) {
+    LOG(LL_ERROR, ("Failed to create input task"));
+    return;
+  }
+  for (auto &b : s_local_btns) {
+    mgos_gpio_setup_input(b.pin, MGOS_GPIO_PULL_UP);
+    b.pressed = !mgos_gpio_read(b.pin);
+    mgos_gpio_set_int_handler_isr(b.pin, MGOS_GPIO_INT_EDGE_ANY,
+                                  LocalButtonIntHandler, nullptr);
+    mgos_gpio_enable_int(b.pin);
   }
   s_ir_ch.Init();
   s_ir_ch.SetIntHandler(IRRMTIntHandler, nullptr);
-  mgos_gpio_setup_input(IR_GPIO, MGOS_GPIO_PULL_NONE);
-  mgos_gpio_set_int_handler_isr(IR_GPIO, MGOS_GPIO_INT_EDGE_NEG,
-                                IRGPIOIntHandler, nullptr);
-  mgos_gpio_enable_int(IR_GPIO);
+  s_ir_ch.Attach();
+  s_ir_ch.ClearInt();
+  s_ir_ch.EnableInt();
+  s_ir_ch.Start();
 }
 
 }  // namespace clk
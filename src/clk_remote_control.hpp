@@ -5,8 +5,12 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #include "mgos_event.h"
 
+#include "clk_rmt_item.hpp"
+
 #define CLK_BTN_EV_BASE MGOS_EVENT_BASE('B', 'T', 'N')
 
 namespace clk {
@@ -36,6 +40,33 @@ struct RemoteControlButtonUpEventArg {
   RemoteControlButton btn;
 };
 
+// Input from the IR receiver and the local buttons (K1 - K3) is queued by
+// interrupt handlers and processed by a dedicated task. Button events are
+// triggered on the main task.
 void RemoteControlInit();
 
+struct InputStats {
+  uint32_t num_ir_events, num_btn_events;
+  // Events lost because a queue was full.
+  uint32_t num_dropped;
+  // Times the task woke up to process events, max events processed at once.
+  uint32_t num_batches, max_batch;
+  // Time from the interrupt to the button event being handed to the main task.
+  // For IR, since the end of reception, for local buttons, since the first
+  // edge (includes debouncing).
+  uint32_t num_ir_codes, ir_latency_us_last, ir_latency_us_max;
+  uint64_t ir_latency_us_sum;
+  uint32_t num_btn_presses, btn_latency_us_last, btn_latency_us_max;
+  uint64_t btn_latency_us_sum;
+};
+
+void GetInputStats(InputStats *st, bool reset);
+
+// Raw items of the last few receptions, for analysis and replay.
+static constexpr int kNumIRCaptures = 4;
+
+// Copies the |idx|-th most recent reception (0 - the last one) to |items|.
+// Returns the number of items, 0 if there is none.
+size_t GetIRCapture(int idx, RMTItem *items, size_t max_len);
+
 }  // namespace clk
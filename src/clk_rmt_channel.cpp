@@ -5,17 +5,25 @@
 
 #include "clk_rmt_channel.hpp"
 
+#include <algorithm>
+
 #include "mgos.hpp"
 
 #include "driver/periph_ctrl.h"
+#include "freertos/FreeRTOS.h"
 #include "soc/rmt_reg.h"
 #include "soc/rmt_struct.h"
+#include "xtensa/hal.h"
 
 namespace clk {
 
 // static
 intr_handle_t RMTChannel::inth_ = 0;
-RMTChannel *RMTChannel::int_handler_objs_[RMT_NUM_CH] = {};
+RMTChannel::IntTableEntry RMTChannel::int_table_[RMT_NUM_CH] = {};
+uint32_t RMTChannel::int_entry_ccount_ = 0;
+RMTChannel *RMTChannel::mem_objs_[RMT_NUM_CH] = {};
+
+static portMUX_TYPE s_int_ena_mux = portMUX_INITIALIZER_UNLOCKED;
 
 RMTChannel::RMTChannel(uint8_t ch, int pin, bool idle_value)
     : ch_(ch), pin_(pin), idle_value_(idle_value), data_({}) {
@@ -28,40 +36,114 @@ void RMTChannel::Init() {
   Clear(true, true);
 }
 
-const RMTChannel::Item *RMTChannel::data() const {
+IRAM const RMTChannel::Item *RMTChannel::data() const {
   return &data_.items[0];
 }
 
-size_t RMTChannel::len() const {
+IRAM size_t RMTChannel::len() const {
   return len_;
 }
 
 void RMTChannel::Clear(bool buf, bool mem) {
+  if (buf) {
+    // Anything past the end is never used, only clear what was.
+    for (size_t i = 0; i < (len_ + 1) / 2; i++) {
+      data_.data32[i] = 0;
+    }
+  }
+  if (mem) {
+    for (size_t i = 0; i < kMemLen / 2; i++) {
+      RMTMEM.chan[ch_].data32[i].val = 0;
+    }
+    InvalidateMem();
+  }
   len_ = 0;
   tot_len_ = 0;
-  for (size_t i = 0; i < ARRAY_SIZE(data_.data32); i++) {
-    if (buf) data_.data32[i] = 0;
-    if (mem) RMTMEM.chan[ch_].data32[i].val = 0;
-  }
+  MarkDirty(0);
 }
 
-IRAM void RMTChannel::Upload() {
-  const uint32_t *src = data_.data32;
-  uint32_t *dst = (uint32_t *) &RMTMEM.chan[ch_].data32[0].val;
-  for (int num_words = len_ / 2; num_words > 0; num_words--) {
+IRAM void RMTChannel::MarkDirty(size_t pos) {
+  if (pos < dirty_pos_) dirty_pos_ = pos;
+}
+
+IRAM void RMTChannel::InvalidateMem() {
+  if (mem_objs_[ch_] == this) mem_objs_[ch_] = nullptr;
+}
+
+IRAM void RMTChannel::CopyToMem(size_t pos, size_t mem_pos, size_t n,
+                                bool end) {
+  const uint32_t *src = &data_.data32[pos / 2];
+  uint32_t *dst = (uint32_t *) &RMTMEM.chan[ch_].data32[mem_pos / 2].val;
+  size_t num_words = n / 2;
+  // Peripheral memory is slow to access, load a few words and then store them
+  // back to back so stores are not interleaved with loads.
+  for (; num_words >= 4; num_words -= 4, src += 4, dst += 4) {
+    uint32_t w0 = src[0], w1 = src[1], w2 = src[2], w3 = src[3];
+    dst[0] = w0;
+    dst[1] = w1;
+    dst[2] = w2;
+    dst[3] = w3;
+  }
+  for (; num_words > 0; num_words--) {
     *dst++ = *src++;
   }
-  if (len_ % 2 == 0) {
+  if (!end) return;
+  if (n % 2 == 0) {
     *dst = (((uint32_t) idle_value_) << 15);
   } else {
     *dst = (*src & 0xffff) | (((uint32_t) idle_value_) << 31);
   }
 }
 
+IRAM void RMTChannel::Upload() {
+  const uint32_t thr_int_mask = (RMT_CH0_TX_THR_EVENT_INT_ENA << ch_);
+  if (len_ < kMemLen) {
+    if (mem_objs_[ch_] != this) {
+      mem_objs_[ch_] = this;
+      dirty_pos_ = 0;
+    }
+    if (dirty_pos_ != kNotDirty) {
+      // Copy whole words, end marker is always rewritten.
+      size_t pos = (std::min<size_t>(dirty_pos_, len_) & ~1U);
+      CopyToMem(pos, pos, len_ - pos, true /* end */);
+      dirty_pos_ = kNotDirty;
+    }
+    if (stream_pos_ != 0) {
+      UpdateIntEna(0, thr_int_mask);
+      stream_pos_ = 0;
+    }
+    return;
+  }
+  // Fill the whole block, memory wraps around and the threshold interrupt
+  // fires every half block. Memory is overwritten as we go, so next time it
+  // will need to be uploaded in full again.
+  mem_objs_[ch_] = nullptr;
+  CopyToMem(0, 0, kMemLen, false /* end */);
+  RMT.int_clr.val = thr_int_mask;
+  if (stream_pos_ == 0) {
+    RMT.tx_lim_ch[ch_].limit = kMemLen / 2;
+    UpdateIntEna(thr_int_mask, 0);
+  }
+  stream_pos_ = kMemLen;
+}
+
+IRAM void RMTChannel::Refill() {
+  // Done when the end marker has been written.
+  if (stream_pos_ == 0 || stream_pos_ > len_) return;
+  size_t n = len_ - stream_pos_;
+  bool end = (n < kMemLen / 2);
+  if (!end) n = kMemLen / 2;
+  CopyToMem(stream_pos_, stream_pos_ % kMemLen, n, end);
+  stream_pos_ += (end ? n + 1 : n);
+}
+
 IRAM void RMTChannel::Download() {
   len_ = 0;
   tot_len_ = 0;
-  for (size_t i = 0; i < ARRAY_SIZE(data_.data32); i++) {
+  // Buffer now matches the memory.
+  mem_objs_[ch_] = this;
+  dirty_pos_ = kNotDirty;
+  for (size_t i = 0; i < kMemLen / 2; i++) {
     data_.data32[i] = RMTMEM.chan[ch_].data32[i].val;
     uint32_t l = data_.items[len_].num_cycles;
     if (l == 0) break;
@@ -81,7 +163,22 @@ IRAM void RMTChannel::Download() {
        << ((ch) *3))))
 
 IRAM void RMTChannel::DisableInt() {
-  RMT.int_ena.val &= ~RMT_CH_INT_MASK(ch_);
+  UpdateIntEna(0, RMT_CH_INT_MASK(ch_));
+}
+
+// static
+IRAM void RMTChannel::UpdateIntEna(uint32_t set_mask, uint32_t clear_mask) {
+  // Critical section keeps out the interrupt handler on this core,
+  // the spinlock - code running on the other one.
+  if (xPortInIsrContext()) {
+    portENTER_CRITICAL_ISR(&s_int_ena_mux);
+    RMT.int_ena.val = (RMT.int_ena.val & ~clear_mask) | set_mask;
+    portEXIT_CRITICAL_ISR(&s_int_ena_mux);
+  } else {
+    portENTER_CRITICAL(&s_int_ena_mux);
+    RMT.int_ena.val = (RMT.int_ena.val & ~clear_mask) | set_mask;
+    portEXIT_CRITICAL(&s_int_ena_mux);
+  }
 }
 
 IRAM void RMTChannel::ClearInt() {
@@ -114,27 +211,53 @@ IRAM void RMTChannel::SetIntHandler(void (*handler)(RMTChannel *obj, void *arg),
 
 // static
 IRAM void RMTChannel::SetIntHandlerInternal(uint8_t ch, RMTChannel *obj) {
-  int_handler_objs_[ch] = obj;
+  IntTableEntry &e = int_table_[ch];
+  e.handler = (obj != nullptr ? obj->int_handler_ : nullptr);
+  e.arg = (obj != nullptr ? obj->int_handler_arg_ : nullptr);
+  e.obj = obj;
   if (inth_ == 0) {
     esp_intr_alloc(ETS_RMT_INTR_SOURCE, 0, RMTIntHandler, nullptr, &inth_);
     esp_intr_set_in_iram(inth_, true);
   }
 }
 
+// static
+IRAM uint32_t RMTChannel::int_entry_ccount() {
+  return int_entry_ccount_;
+}
+
 // static
 IRAM void RMTChannel::RMTIntHandler(void *arg) {
+  int_entry_ccount_ = xthal_get_ccount();
   uint32_t int_st = RMT.int_st.val;
-  uint32_t int_mask1 = RMT_CH0_TX_THR_EVENT_INT_ST;
-  uint32_t int_mask2 =
-      (RMT_CH0_ERR_INT_ST | RMT_CH0_RX_END_INT_ST | RMT_CH0_TX_END_INT_ST);
-  for (size_t ch = 0; ch < RMT_NUM_CH; ch++, int_mask1 <<= 1, int_mask2 <<= 3) {
+  // Channel N has bits 3N - 3N+2 (TX end, RX end, error) and 24+N (TX
+  // threshold). Fold each group of three into one bit and pack them so bit N
+  // of |pending| is set if channel N needs attention.
+  uint32_t pending = (int_st | (int_st >> 1) | (int_st >> 2)) & 0x249249;
+  pending = (pending | (pending >> 2)) & 0x0c30c3;
+  pending = (pending | (pending >> 4)) & 0x00f00f;
+  pending = (pending | (pending >> 8)) & 0xff;
+  pending |= (int_st >> 24);
+  while (pending != 0) {
+    int ch = __builtin_ctz(pending);
+    pending &= (pending - 1);
+    uint32_t int_mask1 = (RMT_CH0_TX_THR_EVENT_INT_ST << ch);
+    uint32_t int_mask2 =
+        ((RMT_CH0_ERR_INT_ST | RMT_CH0_RX_END_INT_ST | RMT_CH0_TX_END_INT_ST)
+         << (ch * 3));
     uint32_t ch_int_mask = int_mask1 | int_mask2;
     uint32_t ch_int_st = (int_st & ch_int_mask);
-    if (ch_int_st == 0) continue;
     RMT.int_clr.val = ch_int_mask;
-    RMTChannel *obj = int_handler_objs_[ch];
-    if (obj == nullptr || obj->int_handler_ == nullptr) continue;
-    obj->int_handler_(obj, obj->int_handler_arg_);
+    const IntTableEntry &e = int_table_[ch];
+    if (e.obj == nullptr) continue;
+    if (e.obj->stream_pos_ != 0 && (ch_int_st & int_mask1)) {
+      // Threshold events of a streaming channel are ours.
+      e.obj->Refill();
+      ch_int_st &= ~int_mask1;
+      if (ch_int_st == 0) continue;
+    }
+    if (e.handler == nullptr) continue;
+    e.handler(e.obj, e.arg);
   }
   (void) arg;
 }
@@ -5,11 +5,14 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "esp_intr_alloc.h"
 #include "soc/rmt_struct.h"
 
+#include "clk_rmt_item.hpp"
+
 #define RMT_NUM_CH (sizeof(RMT.conf_ch) / sizeof(RMT.conf_ch[0]))
 
 namespace clk {
@@ -21,10 +24,14 @@ class RMTChannel {
 
   virtual void Init();
 
-  struct Item {
-    uint16_t num_cycles : 15;
-    uint16_t val : 1;
-  } __attribute__((packed));
+  typedef RMTItem Item;
+
+  // Size of the channel's peripheral memory block, in items.
+  static constexpr size_t kMemLen = 128;
+  // Size of the buffer. Sequences that do not fit in the peripheral memory
+  // are streamed: the block is refilled half at a time from the TX threshold
+  // interrupt.
+  static constexpr size_t kMaxLen = 4 * kMemLen;
 
   const Item *data() const;
   size_t len() const;
@@ -32,7 +39,13 @@ class RMTChannel {
   // Clear the data buffer and/or peripheral memory.
   void Clear(bool buf = true, bool mem = false);
   // Upload the sequence from the buffer to the peripheral.
+  // If it does not fit, only the first block is uploaded and the rest is fed
+  // by Refill() as transmission progresses.
+  // If the peripheral memory still holds this channel's sequence, only the
+  // part that changed since the last upload is copied.
   void Upload();
+  // Refill the half of the memory block that has just been transmitted.
+  void Refill();
   // Download the sequence from the peripheral memory to the buffer.
   void Download();
 
@@ -43,6 +56,10 @@ class RMTChannel {
 
   void SetIntHandler(void (*handler)(RMTChannel *obj, void *arg), void *arg);
 
+  // CPU cycle count at the entry to the shared RMT interrupt handler,
+  // valid while a channel handler is running.
+  static uint32_t int_entry_ccount();
+
   // Start/stop the channel.
   virtual void Start() = 0;
   virtual void Stop() = 0;
@@ -65,20 +82,51 @@ class RMTChannel {
   uint32_t conf1_start_ = 0;
   uint32_t conf1_stop_ = 0;
 
+  // Streaming position: next item to upload, 0 if not streaming.
+  uint32_t stream_pos_ = 0;
+
+  // First item that changed since the last upload, kNotDirty if none.
+  static constexpr uint32_t kNotDirty = 0xffffffff;
+  uint32_t dirty_pos_ = 0;
+
   union {
-    Item items[128];
-    uint32_t data32[64];
-  } __attribute__((packed)) data_;
+    Item items[kMaxLen];
+    uint32_t data32[kMaxLen / 2];
+  } data_;
+  static_assert(sizeof(Item) == 2, "Two items per word are assumed");
+
+  // Copy |n| items from the buffer at |pos| to the memory at |mem_pos|,
+  // optionally followed by the end marker.
+  void CopyToMem(size_t pos, size_t mem_pos, size_t n, bool end);
 
   static void SetIntHandlerInternal(uint8_t ch, RMTChannel *obj);
 
+  // Set and clear bits in RMT.int_ena. The register is shared by all the
+  // channels and modified both by tasks and by the interrupt handler,
+  // all changes must go through here.
+  static void UpdateIntEna(uint32_t set_mask, uint32_t clear_mask);
+
+  // Items starting at |pos| have been changed.
+  void MarkDirty(size_t pos);
+  // Peripheral memory of the channel has been overwritten.
+  void InvalidateMem();
+
   void (*int_handler_)(RMTChannel *, void *arg) = nullptr;
   void *int_handler_arg_ = nullptr;
 
  private:
   static intr_handle_t inth_;
 
-  static RMTChannel *int_handler_objs_[RMT_NUM_CH];
+  // Everything the interrupt dispatcher needs for a channel, in one place.
+  struct IntTableEntry {
+    RMTChannel *obj;
+    void (*handler)(RMTChannel *obj, void *arg);
+    void *arg;
+  };
+  static IntTableEntry int_table_[RMT_NUM_CH];
+  static uint32_t int_entry_ccount_;
+  // Object whose sequence peripheral memory of the channel contains.
+  static RMTChannel *mem_objs_[RMT_NUM_CH];
 
   static void RMTIntHandler(void *arg);
 };
@@ -41,8 +41,10 @@ void RMTInputChannel::Init() {
 }
 
 IRAM void RMTInputChannel::EnableInt() {
-  uint32_t ch_int_mask = (RMT_CH0_RX_END_INT_ENA << (ch_ * 3));
-  RMT.int_ena.val |= ch_int_mask;
+  // Errors (memory full) also end reception and need to be handled.
+  uint32_t ch_int_mask =
+      ((RMT_CH0_RX_END_INT_ENA | RMT_CH0_ERR_INT_ENA) << (ch_ * 3));
+  UpdateIntEna(ch_int_mask, 0);
 }
 
 IRAM void RMTInputChannel::Start() {
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace clk {
+
+// Sequence item, same layout as in the RMT peripheral memory.
+struct RMTItem {
+  uint16_t num_cycles : 15;
+  uint16_t val : 1;
+} __attribute__((packed));
+
+}  // namespace clk
@@ -55,7 +55,7 @@ IRAM void RMTOutputChannel::EnableInt() {
   if (tx_int_thresh_ > 0) {
     ch_int_mask |= (RMT_CH0_TX_THR_EVENT_INT_ENA << ch_);
   }
-  RMT.int_ena.val |= ch_int_mask;
+  UpdateIntEna(ch_int_mask, 0);
 }
 
 IRAM void RMTOutputChannel::Val(bool val, uint16_t num_cycles) {
@@ -64,6 +64,7 @@ IRAM void RMTOutputChannel::Val(bool val, uint16_t num_cycles) {
   if (len_ > 0) {
     Item *last = &data_.items[len_ - 1];
     if (val == last->val) {
+      MarkDirty(len_ - 1);
       uint16_t avail = 0x7fff - last->num_cycles;
       if (avail >= num_cycles) {
         last->num_cycles += num_cycles;
@@ -76,6 +77,13 @@ IRAM void RMTOutputChannel::Val(bool val, uint16_t num_cycles) {
       }
     }
   }
+  // Keep the last item for the end marker.
+  if (len_ >= ARRAY_SIZE(data_.items) - 1) {
+    LOG(LL_ERROR, ("%d: sequence too long", ch_));
+    tot_len_ -= num_cycles;
+    return;
+  }
+  MarkDirty(len_);
   Item *next = &data_.items[len_];
   next->num_cycles = num_cycles;
   next->val = val;
@@ -106,12 +114,53 @@ IRAM void RMTOutputChannel::OffTo(const RMTOutputChannel &other) {
   Val(!on_value_, diff);
 }
 
+IRAM void RMTOutputChannel::Append(const Item *items, size_t n, bool merge) {
+  if (n == 0) return;
+  size_t i = 0;
+  if (merge) {
+    // First item may need to be merged with the last one.
+    Val(items[0].val, items[0].num_cycles);
+    i++;
+  }
+  if (len_ + n - i >= ARRAY_SIZE(data_.items)) {
+    LOG(LL_ERROR, ("%d: sequence too long", ch_));
+    return;
+  }
+  MarkDirty(len_);
+  for (; i < n; i++) {
+    data_.items[len_++] = items[i];
+    tot_len_ += items[i].num_cycles;
+  }
+}
+
+bool RMTOutputChannel::Splice(size_t pos, size_t old_n, const Item *items,
+                              size_t n) {
+  if (pos + old_n > len_ || len_ - old_n + n >= ARRAY_SIZE(data_.items)) {
+    LOG(LL_ERROR, ("%d: invalid splice %d %d %d", ch_, (int) pos, (int) old_n,
+                   (int) n));
+    return false;
+  }
+  MarkDirty(pos);
+  for (size_t i = 0; i < old_n; i++) {
+    tot_len_ -= data_.items[pos + i].num_cycles;
+  }
+  memmove(&data_.items[pos + n], &data_.items[pos + old_n],
+          (len_ - pos - old_n) * sizeof(Item));
+  memcpy(&data_.items[pos], items, n * sizeof(Item));
+  for (size_t i = 0; i < n; i++) {
+    tot_len_ += items[i].num_cycles;
+  }
+  len_ = len_ - old_n + n;
+  return true;
+}
+
 IRAM void RMTOutputChannel::Start() {
   RMT.conf_ch[ch_].conf1.val = conf1_start_;
 }
 
 IRAM void RMTOutputChannel::Stop() {
   RMTMEM.chan[ch_].data32[0].val = 0;
+  InvalidateMem();
   RMT.conf_ch[ch_].conf1.val = conf1_stop_;
 }
 
@@ -119,6 +168,8 @@ IRAM void RMTOutputChannel::Attach() {
   if (pin_ <= 0) return;
   gpio_matrix_out(pin_, RMT_SIG_OUT0_IDX + ch_, 0, 0);
   SetIntHandler(int_handler_, int_handler_arg_);
+  // Needed for streaming, even if there is no handler.
+  SetIntHandlerInternal(ch_, this);
 }
 
 IRAM void RMTOutputChannel::Detach() {
@@ -26,6 +26,10 @@ class RMTOutputChannel : public RMTChannel {
   void Set(bool on, uint16_t num_cycles);
   void OnTo(const RMTOutputChannel &other);
   void OffTo(const RMTOutputChannel &other);
+  // Append a pre-built sequence of items, values are line levels.
+  void Append(const Item *items, size_t n, bool merge = true);
+  // Replace |old_n| items at |pos| with a pre-built sequence.
+  bool Splice(size_t pos, size_t old_n, const Item *items, size_t n);
 
   void Start() override;
   void Stop() override;
@@ -43,7 +47,7 @@ class RMTOutputChannel : public RMTChannel {
   uint32_t carrier_duty_reg_ = 0;
 
   // Needs conf1_start to optimize starting channels.
-  // friend void RMTOutputChannelSet::Start();
+  friend class RMTOutputChannelSet;
   friend class DisplayController;
 };
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#include "clk_rmt_output_channel_set.hpp"
+
+#include "mgos.hpp"
+
+#include "soc/rmt_reg.h"
+#include "xtensa/xtruntime.h"
+
+namespace clk {
+
+RMTOutputChannelSet::RMTOutputChannelSet(
+    std::initializer_list<const RMTOutputChannel *> chs) {
+  for (const RMTOutputChannel *ch : chs) {
+    if (num_ >= (int) RMT_NUM_CH) break;
+    volatile uint32_t *reg =
+        (volatile uint32_t *) (RMT_CH0CONF1_REG + ch->ch_ * 8);
+    start_[num_] = {reg, ch->conf1_start_};
+    loop_start_[num_] = {reg, ch->conf1_start_ | RMT_TX_CONTI_MODE_CH0};
+    // Must not reset the read pointer or the clock divider of the channel
+    // while it is transmitting.
+    loop_stop_[num_] = {reg, ch->conf1_start_ & ~(RMT_TX_CONTI_MODE_CH0 |
+                                                  RMT_MEM_RD_RST_CH0 |
+                                                  RMT_REF_CNT_RST_CH0)};
+    mask_ |= (1 << ch->ch_);
+    num_++;
+  }
+}
+
+uint32_t RMTOutputChannelSet::mask() const {
+  return mask_;
+}
+
+IRAM void RMTOutputChannelSet::Start(bool loop) const {
+  Run((loop ? loop_start_ : start_), num_);
+}
+
+IRAM void RMTOutputChannelSet::StopLoop() const {
+  Run(loop_stop_, num_);
+}
+
+// static
+IRAM void RMTOutputChannelSet::Run(const Store *stores, int n) {
+  uint32_t level = XTOS_DISABLE_ALL_INTERRUPTS;
+  for (const Store *s = stores, *end = stores + n; s < end; s++) {
+    *s->reg = s->val;
+  }
+  XTOS_RESTORE_INTLEVEL(level);
+}
+
+}  // namespace clk
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <initializer_list>
+
+#include "clk_rmt_output_channel.hpp"
+
+namespace clk {
+
+// A group of output channels that are started together.
+// Register addresses and values are computed once, at construction, starting
+// the set is a run of back to back stores with all interrupts disabled, so
+// skew between the first and the last channel is a few CPU cycles per channel
+// regardless of what else is going on.
+// Holds no references to the channels and can be copied along with them.
+class RMTOutputChannelSet {
+ public:
+  RMTOutputChannelSet(std::initializer_list<const RMTOutputChannel *> chs);
+  RMTOutputChannelSet(const RMTOutputChannelSet &other) = default;
+
+  // Mask of the channels in the set.
+  uint32_t mask() const;
+
+  // Start all the channels, in continuous mode if |loop| is set.
+  void Start(bool loop = false) const;
+
+  // Turn off continuous mode: channels stop at the end of the current pass.
+  void StopLoop() const;
+
+ private:
+  struct Store {
+    volatile uint32_t *reg;
+    uint32_t val;
+  };
+
+  int num_ = 0;
+  uint32_t mask_ = 0;
+  Store start_[RMT_NUM_CH];
+  Store loop_start_[RMT_NUM_CH];
+  Store loop_stop_[RMT_NUM_CH];
+
+  static void Run(const Store *stores, int n);
+};
+
+}  // namespace clk
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "mgos.h"
+
+namespace clk {
+
+// Fixed-size lock-free single producer / single consumer queue.
+// Producer may be an interrupt handler.
+template <class T, size_t N>
+class SPSCQueue {
+ public:
+  static_assert((N & (N - 1)) == 0, "Size must be a power of 2");
+
+  // Producer side.
+  IRAM size_t Free() const {
+    return N - (head_.load(std::memory_order_relaxed) -
+                tail_.load(std::memory_order_acquire));
+  }
+
+  IRAM bool Push(const T &v) {
+    return PushN(&v, 1);
+  }
+
+  // Pushes all |n| values or none.
+  IRAM bool PushN(const T *v, size_t n) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (N - (head - tail_.load(std::memory_order_acquire)) < n) return false;
+    for (size_t i = 0; i < n; i++) {
+      buf_[(head + i) % N] = v[i];
+    }
+    head_.store(head + n, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+  bool Pop(T *v) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    *v = buf_[tail % N];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::atomic<uint32_t> head_{0}, tail_{0};
+  T buf_[N];
+};
+
+}  // namespace clk
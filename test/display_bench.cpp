@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Times frame generation and upload on the host. Absolute numbers say little
+// about the device, this is for comparing changes.
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#include "mgos.h"
+
+#include "clk_display_controller.hpp"
+
+using namespace clk;
+
+int main(int argc, char **argv) {
+  int num_iter = (argc > 1 ? atoi(argv[1]) : 10000);
+  if (num_iter <= 0) return 1;
+  int64_t full_us = 0, incr_us = 0;
+  BenchSetDigits(num_iter, &full_us, &incr_us);
+  printf("SetDigits: full %.3f us, incremental %.3f us\n",
+         (double) full_us / num_iter, (double) incr_us / num_iter);
+
+  std::unique_ptr<DisplayController> ctl(new DisplayController(nullptr));
+  ctl->Init();
+  const uint8_t digits[2][DisplayController::kNumDigits] = {
+      {0x9f, 0x25, DisplayController::kDigitValueColon, 0x0d, 0x99},
+      {0x9f, 0x25, DisplayController::kDigitValueColon, 0x0d, 0x49},
+  };
+  int64_t start = mgos_uptime_micros();
+  for (int i = 0; i < num_iter; i++) {
+    ctl->SetDigits(digits[i % 2], 0, 1500, 0, 0, 1000, 0, 800);
+    ctl->Upload();
+  }
+  int64_t upload_us = mgos_uptime_micros() - start;
+  printf("SetDigits + Upload: %.3f us\n", (double) upload_us / num_iter);
+  return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Builds frames with the real sequence generation code and checks what the
+// display model says was lit.
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "clk_display_controller.hpp"
+#include "clk_display_model.hpp"
+
+using namespace clk;
+
+static const char *s_test = "";
+static int s_num_checks = 0, s_num_failed = 0;
+
+#define CHECK_EQ(a, b)                                                  \
+  do {                                                                  \
+    long long a_ = (long long) (a), b_ = (long long) (b);               \
+    s_num_checks++;                                                     \
+    if (a_ != b_) {                                                     \
+      printf("%s:%d: %s: %s (%lld) != %s (%lld)\n", __FILE__, __LINE__, \
+             s_test, #a, a_, #b, b_);                                   \
+      s_num_failed++;                                                   \
+    }                                                                   \
+  } while (0)
+
+#define CHECK(c) CHECK_EQ(!!(c), true)
+
+// Q slot of each digit, same as kDigitQ for QMAP 1.
+static const int kDigitSlot[DisplayController::kNumDigits] = {
+    1 + 2, 2 + 2, 5 + 2, 3 + 2, 4 + 2,
+};
+
+static const uint8_t kDigits[DisplayController::kNumDigits] = {
+    0x9f, 0x25, DisplayController::kDigitValueColon, 0x0d, 0x99,
+};
+
+static void RunModel(const DisplayController &ctl, DisplayModel::Result *res) {
+  DisplayModel model;
+  ctl.SetupModel(&model);
+  model.Run(res);
+}
+
+// Checks that every digit shows its value for the given number of ticks per
+// colour in |num_pulses| pulses, and nothing else is lit.
+static void CheckFrame(const DisplayController &ctl,
+                       const uint8_t digits[DisplayController::kNumDigits],
+                       const BrightnessLevels &lv, int num_pulses) {
+  DisplayModel::Result res;
+  RunModel(ctl, &res);
+  CHECK(res.in_sync);
+  CHECK_EQ(res.frame_len, ctl.frame_len());
+  CHECK_EQ(res.ghost_ticks, 0);
+  CHECK_EQ(res.latch_while_lit, 0);
+  bool slot_used[DisplayModel::kNumSlots] = {};
+  for (int i = 0; i < DisplayController::kNumDigits; i++) {
+    const bool colon = (i == DisplayController::kColonDigit);
+    const uint16_t lit[3] = {(colon ? lv.rlc : lv.rl), (colon ? lv.glc : lv.gl),
+                             (colon ? lv.blc : lv.bl)};
+    const DisplayModel::Digit &d = res.digits[kDigitSlot[i]];
+    slot_used[kDigitSlot[i]] = true;
+    // Bit 0 is not a segment.
+    CHECK_EQ(d.val | 1, digits[i] | 1);
+    CHECK_EQ(d.num_pulses, num_pulses);
+    for (int c = 0; c < 3; c++) CHECK_EQ(d.lit[c], lit[c]);
+  }
+  for (int slot = 0; slot < DisplayModel::kNumSlots; slot++) {
+    if (slot_used[slot]) continue;
+    const DisplayModel::Digit &d = res.digits[slot];
+    CHECK_EQ(d.num_pulses, 0);
+    CHECK_EQ(d.lit[0] + d.lit[1] + d.lit[2], 0);
+  }
+}
+
+static std::unique_ptr<DisplayController> NewController() {
+  return std::unique_ptr<DisplayController>(new DisplayController(nullptr));
+}
+
+static void TestSinglePulse() {
+  s_test = __func__;
+  auto ctl = NewController();
+  const BrightnessLevels lv = {0, 1500, 0, 0, 1000, 0, 800};
+  CHECK(ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc,
+                       lv.dl));
+  CheckFrame(*ctl, kDigits, lv, 1);
+}
+
+static void TestColours() {
+  s_test = __func__;
+  auto ctl = NewController();
+  const BrightnessLevels lv = {300, 700, 1100, 90, 50, 20, 400};
+  ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl);
+  CheckFrame(*ctl, kDigits, lv, 1);
+}
+
+static void TestBCM() {
+  s_test = __func__;
+  for (int n = 2; n <= DisplayController::kMaxPlanes; n++) {
+    auto ctl = NewController();
+    const BrightnessLevels lv = {0, 1500, 0, 0, 1000, 0, 800};
+    ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                   n);
+    // Slices of each level add up to the level, one pulse per plane.
+    CheckFrame(*ctl, kDigits, lv, n);
+  }
+}
+
+static void TestIncrementalUpdate() {
+  s_test = __func__;
+  const BrightnessLevels lv = {0, 1500, 0, 0, 1000, 0, 800};
+  for (int n = 1; n <= DisplayController::kMaxPlanes; n++) {
+    auto ctl = NewController();
+    ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                   n);
+    uint8_t digits[DisplayController::kNumDigits];
+    memcpy(digits, kDigits, sizeof(digits));
+    digits[4] = 0x49;
+    digits[2] = DisplayController::kDigitValueEmpty;
+    CHECK(ctl->SetDigits(digits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc,
+                         lv.dl, n));
+    CHECK(!ctl->SetDigits(digits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc,
+                          lv.dl, n));
+    // Same result as building the frame from scratch.
+    auto full = NewController();
+    full->SetDigits(digits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                    n);
+    DisplayModel::Result res, full_res;
+    RunModel(*ctl, &res);
+    RunModel(*full, &full_res);
+    CHECK(res.in_sync);
+    CHECK_EQ(res.frame_len, full_res.frame_len);
+    CHECK_EQ(res.ghost_ticks, 0);
+    for (int slot = 0; slot < DisplayModel::kNumSlots; slot++) {
+      const DisplayModel::Digit &d = res.digits[slot],
+                                &fd = full_res.digits[slot];
+      CHECK_EQ(d.val, fd.val);
+      CHECK_EQ(d.num_pulses, fd.num_pulses);
+      for (int c = 0; c < 3; c++) CHECK_EQ(d.lit[c], fd.lit[c]);
+    }
+    // Empty digit is not selected at all.
+    const DisplayModel::Digit &cd = res.digits[kDigitSlot[2]];
+    CHECK_EQ(cd.lit[0] + cd.lit[1] + cd.lit[2], 0);
+    CHECK_EQ(res.digits[kDigitSlot[4]].val | 1, 0x49 | 1);
+  }
+}
+
+static void TestPatchLevels() {
+  s_test = __func__;
+  for (int n = 1; n <= DisplayController::kMaxPlanes; n++) {
+    auto ctl = NewController();
+    const BrightnessLevels lv = {200, 1500, 100, 150, 1000, 50, 800};
+    ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                   n);
+    const BrightnessLevels lv2 = {40, 300, 20, 30, 200, 15, 2000};
+    CHECK(ctl->PatchLevels(lv2));
+    CheckFrame(*ctl, kDigits, lv2, n);
+    CHECK(ctl->PatchLevels(lv));
+    CheckFrame(*ctl, kDigits, lv, n);
+  }
+}
+
+static void TestPatchLevelsKeepsPulses() {
+  s_test = __func__;
+  const int n = DisplayController::kMaxPlanes;
+  auto ctl = NewController();
+  const BrightnessLevels lv = {0, 1500, 0, 0, 1000, 0, 800};
+  ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                 n);
+  // All but the last slice of 1 are empty, but pulses that were generated
+  // are kept at 1 tick each.
+  const BrightnessLevels lv2 = {0, 1, 0, 0, 1, 0, 800};
+  CHECK(ctl->PatchLevels(lv2));
+  const BrightnessLevels lit = {0, n, 0, 0, n, 0, 800};
+  CheckFrame(*ctl, kDigits, lit, n);
+}
+
+static void TestPatchLevelsOutOfRange() {
+  s_test = __func__;
+  for (int n = 1; n <= DisplayController::kMaxPlanes; n++) {
+    auto ctl = NewController();
+    const BrightnessLevels lv = {200, 1500, 100, 150, 1000, 50, 800};
+    ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                   n);
+    const BrightnessLevels lv2 = {40, 300, 20, 30, 200, 15, 2000};
+    CHECK(ctl->PatchLevels(lv2));
+    // Items can't be made this long, the frame stays as it was.
+    const BrightnessLevels long_dl = {200, 1500, 100, 150, 1000, 50, 0xffff};
+    CHECK(!ctl->PatchLevels(long_dl));
+    CheckFrame(*ctl, kDigits, lv2, n);
+    const BrightnessLevels long_gl = {200, 0xffff, 100, 150, 1000, 50, 800};
+    CHECK(!ctl->PatchLevels(long_gl));
+    CheckFrame(*ctl, kDigits, lv2, n);
+    // Generated levels can always be restored.
+    CHECK(ctl->PatchLevels(lv));
+    CheckFrame(*ctl, kDigits, lv, n);
+  }
+}
+
+static void TestCopySeqs() {
+  s_test = __func__;
+  auto ctl = NewController(), copy = NewController();
+  const BrightnessLevels lv = {0, 1500, 0, 0, 1000, 0, 800};
+  ctl->SetDigits(kDigits, lv.rl, lv.gl, lv.bl, lv.rlc, lv.glc, lv.blc, lv.dl,
+                 2);
+  copy->CopySeqs(*ctl);
+  CheckFrame(*copy, kDigits, lv, 2);
+}
+
+int main() {
+  TestSinglePulse();
+  TestColours();
+  TestBCM();
+  TestIncrementalUpdate();
+  TestPatchLevels();
+  TestPatchLevelsKeepsPulses();
+  TestPatchLevelsOutOfRange();
+  TestCopySeqs();
+  printf("%d checks, %d failed\n", s_num_checks, s_num_failed);
+  return (s_num_failed == 0 ? 0 : 1);
+}
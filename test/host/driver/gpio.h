@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIN_FUNC_GPIO 2
+#define PIN_FUNC_SELECT(reg, func) ((void) (reg), (void) (func))
+
+#define RMT_SIG_IN0_IDX 83
+#define RMT_SIG_OUT0_IDX 87
+#define SIG_GPIO_OUT_IDX 256
+
+typedef int gpio_num_t;
+typedef enum {
+  GPIO_MODE_INPUT,
+  GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+extern const uint32_t GPIO_PIN_MUX_REG[40];
+
+int gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode);
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv,
+                     bool oen_inv);
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  PERIPH_RMT_MODULE,
+} periph_module_t;
+
+void periph_module_enable(periph_module_t periph);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int esp_clk_cpu_freq(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ETS_RMT_INTR_SOURCE 47
+
+typedef struct intr_handle_data_t *intr_handle_t;
+typedef void (*intr_handler_t)(void *arg);
+
+// Never calls the handler, tests invoke it directly if needed.
+int esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg,
+                   intr_handle_t *ret_handle);
+int esp_intr_set_in_iram(intr_handle_t handle, bool is_in_iram);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Host tests are single-threaded, critical sections only check nesting.
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+
+typedef struct {
+  uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED \
+  { 0 }
+
+static inline void vPortEnterCritical(portMUX_TYPE *mux) {
+  assert(mux->count == 0);
+  mux->count++;
+}
+
+static inline void vPortExitCritical(portMUX_TYPE *mux) {
+  assert(mux->count == 1);
+  mux->count--;
+}
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
+
+static inline BaseType_t xPortInIsrContext(void) {
+  return 0;
+}
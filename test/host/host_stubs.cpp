@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Host implementations of the platform functions used by the display code.
+
+#include <chrono>
+
+#include "driver/gpio.h"
+#include "driver/periph_ctrl.h"
+#include "esp32/clk.h"
+#include "esp_intr_alloc.h"
+#include "esp_timer.h"
+#include "mgos.h"
+#include "soc/rmt_struct.h"
+#include "xtensa/hal.h"
+
+rmt_dev_t RMT;
+rmt_mem_t RMTMEM;
+
+const uint32_t GPIO_PIN_MUX_REG[40] = {};
+
+static int64_t HostMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t esp_timer_get_time(void) {
+  return HostMicros();
+}
+
+int64_t mgos_uptime_micros(void) {
+  return HostMicros();
+}
+
+int esp_clk_cpu_freq(void) {
+  return 240000000;
+}
+
+uint32_t xthal_get_ccount(void) {
+  return (uint32_t) (HostMicros() * (esp_clk_cpu_freq() / 1000000));
+}
+
+int esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg,
+                   intr_handle_t *ret_handle) {
+  *ret_handle = nullptr;
+  (void) source;
+  (void) flags;
+  (void) handler;
+  (void) arg;
+  return 0;
+}
+
+int esp_intr_set_in_iram(intr_handle_t handle, bool is_in_iram) {
+  (void) handle;
+  (void) is_in_iram;
+  return 0;
+}
+
+void periph_module_enable(periph_module_t periph) {
+  (void) periph;
+}
+
+int gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode) {
+  (void) gpio_num;
+  (void) mode;
+  return 0;
+}
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv,
+                     bool oen_inv) {
+  (void) gpio;
+  (void) signal_idx;
+  (void) out_inv;
+  (void) oen_inv;
+}
+
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv) {
+  (void) gpio;
+  (void) signal_idx;
+  (void) inv;
+}
+
+bool mgos_gpio_setup_output(int pin, bool level) {
+  (void) pin;
+  (void) level;
+  return true;
+}
+
+bool mgos_gpio_toggle(int pin) {
+  (void) pin;
+  return true;
+}
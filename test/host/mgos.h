@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Host stand-in for the parts of the Mongoose OS API used by the display
+// code.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IRAM
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum cs_log_level {
+  LL_NONE = -1,
+  LL_ERROR = 0,
+  LL_WARN = 1,
+  LL_INFO = 2,
+  LL_DEBUG = 3,
+  LL_VERBOSE_DEBUG = 4,
+};
+
+#define LOG(l, x)         \
+  do {                    \
+    if ((l) <= LL_WARN) { \
+      printf x;           \
+      printf("\n");       \
+    }                     \
+  } while (0)
+
+int64_t mgos_uptime_micros(void);
+
+bool mgos_gpio_setup_output(int pin, bool level);
+bool mgos_gpio_toggle(int pin);
+
+#ifdef __cplusplus
+}
+#endif
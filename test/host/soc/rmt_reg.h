@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "soc/rmt_struct.h"
+
+// Channel registers are 8 bytes apart, same as on the chip.
+#define RMT_CH0CONF1_REG ((uintptr_t) &RMT.conf_ch[0].conf1)
+
+#define RMT_CARRIER_OUT_LV_CH0 (1 << 29)
+#define RMT_CARRIER_EN_CH0 (1 << 28)
+#define RMT_MEM_SIZE_CH0_S 24
+#define RMT_IDLE_THRES_CH0_S 8
+#define RMT_DIV_CNT_CH0_S 0
+
+#define RMT_IDLE_OUT_EN_CH0 (1 << 19)
+#define RMT_IDLE_OUT_LV_CH0 (1 << 18)
+#define RMT_REF_ALWAYS_ON_CH0 (1 << 17)
+#define RMT_REF_CNT_RST_CH0 (1 << 16)
+#define RMT_RX_FILTER_THRES_CH0_S 8
+#define RMT_RX_FILTER_EN_CH0 (1 << 7)
+#define RMT_TX_CONTI_MODE_CH0 (1 << 6)
+#define RMT_MEM_OWNER_CH0 (1 << 5)
+#define RMT_MEM_RD_RST_CH0 (1 << 3)
+#define RMT_MEM_WR_RST_CH0 (1 << 2)
+#define RMT_RX_EN_CH0 (1 << 1)
+#define RMT_TX_START_CH0 (1 << 0)
+
+#define RMT_CH0_TX_THR_EVENT_INT_ENA (1 << 24)
+#define RMT_CH0_ERR_INT_ENA (1 << 2)
+#define RMT_CH0_RX_END_INT_ENA (1 << 1)
+#define RMT_CH0_TX_END_INT_ENA (1 << 0)
+#define RMT_CH0_TX_THR_EVENT_INT_ST (1 << 24)
+#define RMT_CH0_ERR_INT_ST (1 << 2)
+#define RMT_CH0_RX_END_INT_ST (1 << 1)
+#define RMT_CH0_TX_END_INT_ST (1 << 0)
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Host stand-in for the RMT peripheral registers and memory. Only the
+// registers the code uses are present, RMT and RMTMEM are plain variables
+// that tests can inspect.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef union {
+  struct {
+    uint32_t ch0_tx_end : 1;
+    uint32_t ch0_rx_end : 1;
+    uint32_t ch0_err : 1;
+    uint32_t reserved3 : 29;
+  };
+  uint32_t val;
+} rmt_int_reg_t;
+
+typedef volatile struct rmt_dev_s {
+  struct {
+    union {
+      struct {
+        uint32_t div_cnt : 8;
+        uint32_t idle_thres : 16;
+        uint32_t mem_size : 4;
+        uint32_t carrier_en : 1;
+        uint32_t carrier_out_lv : 1;
+        uint32_t mem_pd : 1;
+        uint32_t clk_en : 1;
+      };
+      uint32_t val;
+    } conf0;
+    union {
+      struct {
+        uint32_t tx_start : 1;
+        uint32_t rx_en : 1;
+        uint32_t mem_wr_rst : 1;
+        uint32_t mem_rd_rst : 1;
+        uint32_t apb_mem_rst : 1;
+        uint32_t mem_owner : 1;
+        uint32_t tx_conti_mode : 1;
+        uint32_t rx_filter_en : 1;
+        uint32_t rx_filter_thres : 8;
+        uint32_t ref_cnt_rst : 1;
+        uint32_t ref_always_on : 1;
+        uint32_t idle_out_lv : 1;
+        uint32_t idle_out_en : 1;
+        uint32_t reserved20 : 12;
+      };
+      uint32_t val;
+    } conf1;
+  } conf_ch[8];
+  rmt_int_reg_t int_raw;
+  rmt_int_reg_t int_st;
+  rmt_int_reg_t int_ena;
+  rmt_int_reg_t int_clr;
+  union {
+    struct {
+      uint32_t low : 16;
+      uint32_t high : 16;
+    };
+    uint32_t val;
+  } carrier_duty_ch[8];
+  union {
+    struct {
+      uint32_t limit : 9;
+      uint32_t reserved9 : 23;
+    };
+    uint32_t val;
+  } tx_lim_ch[8];
+  union {
+    struct {
+      uint32_t fifo_mask : 1;
+      uint32_t mem_tx_wrap_en : 1;
+      uint32_t reserved2 : 30;
+    };
+    uint32_t val;
+  } apb_conf;
+} rmt_dev_t;
+extern rmt_dev_t RMT;
+
+typedef struct {
+  union {
+    struct {
+      uint32_t duration0 : 15;
+      uint32_t level0 : 1;
+      uint32_t duration1 : 15;
+      uint32_t level1 : 1;
+    };
+    uint32_t val;
+  };
+} rmt_item32_t;
+
+typedef volatile struct rmt_mem_s {
+  struct {
+    rmt_item32_t data32[64];
+  } chan[8];
+} rmt_mem_t;
+extern rmt_mem_t RMTMEM;
+
+#ifdef __cplusplus
+}
+#endif
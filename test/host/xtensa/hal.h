@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Derived from esp_clk_cpu_freq() and the host clock.
+uint32_t xthal_get_ccount(void);
+
+#ifdef __cplusplus
+}
+#endif
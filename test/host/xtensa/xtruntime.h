@@ -0,0 +1,9 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+#pragma once
+
+#define XTOS_DISABLE_ALL_INTERRUPTS 0
+#define XTOS_RESTORE_INTLEVEL(level) ((void) (level))
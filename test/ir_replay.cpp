@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2020 Deomid "rojer" Ryabkov
+ * All rights reserved
+ */
+
+// Replays IR sequences from corpus files through the decoder. Every sequence
+// must decode to the code it is annotated with; perturbed replays are
+// reported along with the decoding cost.
+//
+// Usage: ir_replay [-n num_iter] [-j jitter_pct] [-N noise_pct]
+//                  [-t trunc_pct] file...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "clk_ir_decoder.hpp"
+#include "clk_rmt_channel.hpp"
+
+using namespace clk;
+
+struct CorpusEntry {
+  bool hold;
+  uint32_t code;
+  size_t len;
+  RMTItem items[RMTChannel::kMemLen];
+};
+
+// Parses a "<code>|hold: <len>, <len>, ..." line.
+static bool ParseLine(const char *line, CorpusEntry *e) {
+  const char *p = strchr(line, ':');
+  if (p == nullptr) return false;
+  *e = {};
+  if (strncmp(line, "hold", p - line) == 0) {
+    e->hold = true;
+  } else {
+    char *end;
+    e->code = strtoul(line, &end, 0);
+    if (end != p) return false;
+  }
+  for (p++; *p != '\0' && *p != '\n';) {
+    char *end;
+    long v = strtol(p, &end, 10);
+    if (end == p || v == 0 || v > 0x7fff || v < -0x7fff) return false;
+    if (e->len >= RMTChannel::kMemLen) return false;
+    e->items[e->len].num_cycles = (v > 0 ? v : -v);
+    e->items[e->len].val = (v > 0);
+    e->len++;
+    p = end + strspn(end, ", ");
+  }
+  return e->len > 0;
+}
+
+// Protocol is taken from the file name: "dir/nec.txt" - NEC.
+static bool FileProtocol(const char *path, IRProtocol *proto) {
+  const char *name = strrchr(path, '/');
+  name = (name != nullptr ? name + 1 : path);
+  const char *dot = strchr(name, '.');
+  size_t len = (dot != nullptr ? (size_t) (dot - name) : strlen(name));
+  return IRProtocolFromName(name, len, proto);
+}
+
+int main(int argc, char **argv) {
+  IRBenchParams p = {1000, 10, 0, 0, 1};
+  int opt_i = 1;
+  for (; opt_i + 1 < argc && argv[opt_i][0] == '-'; opt_i += 2) {
+    int v = atoi(argv[opt_i + 1]);
+    switch (argv[opt_i][1]) {
+      case 'n':
+        p.num_iter = v;
+        break;
+      case 'j':
+        p.jitter_pct = v;
+        break;
+      case 'N':
+        p.noise_pct = v;
+        break;
+      case 't':
+        p.trunc_pct = v;
+        break;
+      default:
+        fprintf(stderr, "unknown option %s\n", argv[opt_i]);
+        return 2;
+    }
+  }
+  if (opt_i >= argc || p.num_iter <= 0) {
+    fprintf(stderr, "no corpus files\n");
+    return 2;
+  }
+  int num_seqs = 0, num_failed = 0;
+  int64_t num_ok = 0, num_wrong = 0, num_none = 0;
+  for (int fi = opt_i; fi < argc; fi++) {
+    const char *path = argv[fi];
+    IRProtocol proto;
+    if (!FileProtocol(path, &proto)) {
+      fprintf(stderr, "%s: unknown protocol\n", path);
+      return 2;
+    }
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+      fprintf(stderr, "%s: cannot open\n", path);
+      return 2;
+    }
+    char line[4096];
+    for (int ln = 1; fgets(line, sizeof(line), f) != nullptr; ln++) {
+      if (line[0] == '#' || line[0] == '\n') continue;
+      CorpusEntry e;
+      if (!ParseLine(line, &e)) {
+        fprintf(stderr, "%s:%d: invalid line\n", path, ln);
+        fclose(f);
+        return 2;
+      }
+      IRBenchResult res;
+      BenchIRDecoder(e.items, e.len, p, &res);
+      num_seqs++;
+      bool ok = (res.ref_ok && res.ref.proto == proto &&
+                 res.ref.hold == e.hold && (e.hold || res.ref.code == e.code));
+      if (!ok) {
+        printf("%s:%d: expected %s %s 0x%x, got %s %s 0x%x\n", path, ln,
+               IRProtocolName(proto), (e.hold ? "hold" : "code"),
+               (unsigned) e.code,
+               (res.ref_ok ? IRProtocolName(res.ref.proto) : "none"),
+               (res.ref.hold ? "hold" : "code"), (unsigned) res.ref.code);
+        num_failed++;
+      }
+      printf("%s:%d: %s len %d ok %d%% wrong %d none %d avg %u ns max %u ns\n",
+             path, ln, (ok ? "PASS" : "FAIL"), (int) e.len,
+             (int) ((int64_t) res.num_ok * 100 / p.num_iter), res.num_wrong,
+             res.num_none, res.avg_cycles * 1000 / res.cpu_mhz,
+             res.max_cycles * 1000 / res.cpu_mhz);
+      num_ok += res.num_ok;
+      num_wrong += res.num_wrong;
+      num_none += res.num_none;
+    }
+    fclose(f);
+  }
+  int64_t total = (int64_t) num_seqs * p.num_iter;
+  printf("%d sequences, %d failed; perturbed: ok %d%% wrong %lld none %lld\n",
+         num_seqs, num_failed, (int) (total > 0 ? num_ok * 100 / total : 0),
+         (long long) num_wrong, (long long) num_none);
+  return (num_failed == 0 && num_seqs > 0 ? 0 : 1);
+}